@@ -8,195 +8,5455 @@
 #include <limits.h>
 #include <list>
 #include <algorithm>
+#include <tuple>
+#include <type_traits>
+#include <stdexcept>
+#include <cstdint>
+#include <cctype>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <cstring>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <string_view>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <span>
+#include <utility>
+#include <array>
+#include <charconv>
+#include <bit>
+#include <fcntl.h>
+#include <deque>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// io_uring is only used on Linux, other systems read the file with pread on a background thread
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Thread affinity of the pool workers can only be set on Linux
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Allocator queries used by the memory report to see how much each heap block really takes
+#if defined(__linux__)
+#include <malloc.h>
+#define HAVE_MALLOC_USABLE_SIZE 1
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+// Vector instructions used by the csv tokenizer; without any of them it falls back to plain C++
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
-// Structure to store phone data
-struct Phone {
-    string brand;
-    string model;
-    int releaseYear;
-    float price;
-    float screenSize;
-};
+// Structure to store phone data
+struct Phone {
+    string brand;
+    string model;
+    int releaseYear;
+    float price;
+    float screenSize;
+};
+
+// Version of the phone data, incremented whenever the data is loaded or changed
+// Cached query results are only valid for the version they were computed on
+// It is atomic because shards are loaded by several threads at once
+atomic<unsigned long long> dataVersion = 0;
+
+// One finished span of work: its name and its start and end in nanoseconds of the steady clock
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Ring of the latest trace events of one thread
+// Only the owning thread writes to it, so recording needs no lock: the event is written first and then
+// published by advancing head. When the ring is full the oldest events are overwritten
+struct TraceBuffer {
+    static const size_t capacity = 1 << 16;
+    vector<TraceEvent> events = vector<TraceEvent>(capacity);
+    atomic<uint64_t> head = 0;
+    unsigned threadId;
+    string threadName;
+};
+
+// Tracing state: whether spans are recorded and the buffers of all threads that recorded one
+// A buffer is registered the first time its thread records a span and is kept until the program ends,
+// so the spans of finished threads can still be exported
+struct Tracer {
+    atomic<bool> enabled = false;
+    mutex registryLock;
+    vector<unique_ptr<TraceBuffer>> buffers;
+    static inline thread_local TraceBuffer* threadBuffer = nullptr;
+    static inline thread_local const char* threadName = "thread";
+
+    static uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record(const char* name, uint64_t start, uint64_t end) {
+        if (!threadBuffer) {
+            lock_guard<mutex> guard(registryLock);
+            buffers.push_back(make_unique<TraceBuffer>());
+            threadBuffer = buffers.back().get();
+            threadBuffer->threadId = buffers.size();
+            threadBuffer->threadName = threadName;
+        }
+        uint64_t head = threadBuffer->head.load(memory_order_relaxed);
+        threadBuffer->events[head % TraceBuffer::capacity] = {name, start, end};
+        threadBuffer->head.store(head + 1, memory_order_release);
+    }
+};
+
+Tracer tracer;
+
+// Span of work that is recorded from its construction to the end of its scope when tracing is on
+// The name must be a string literal; when tracing is off a span costs one flag check
+struct TraceSpan {
+    const char* name;
+    uint64_t start = 0;
+
+    explicit TraceSpan(const char* name) : name(name) {
+        if (tracer.enabled.load(memory_order_relaxed)) {
+            start = Tracer::now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (start != 0) {
+            tracer.record(name, start, Tracer::now());
+        }
+    }
+};
+
+// Function to write every recorded span as a Chrome trace (JSON), which opens in Perfetto and chrome://tracing
+// Times are written in microseconds from the earliest span. Returns false if the file cannot be written
+bool writeChromeTrace(const string& filename) {
+    ofstream out(filename);
+    if (!out.is_open()) {
+        return false;
+    }
+    lock_guard<mutex> guard(tracer.registryLock);
+    uint64_t origin = UINT64_MAX;
+    for (const auto& buffer : tracer.buffers) {
+        uint64_t head = buffer->head.load(memory_order_acquire);
+        for (uint64_t i = head - min<uint64_t>(head, TraceBuffer::capacity); i < head; i++) {
+            origin = min(origin, buffer->events[i % TraceBuffer::capacity].start);
+        }
+    }
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : tracer.buffers) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+        << ",\"args\":{\"name\":\"" << buffer->threadName << " " << buffer->threadId << "\"}}";
+        first = false;
+        uint64_t head = buffer->head.load(memory_order_acquire);
+        for (uint64_t i = head - min<uint64_t>(head, TraceBuffer::capacity); i < head; i++) {
+            const TraceEvent& event = buffer->events[i % TraceBuffer::capacity];
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+            << fixed << setprecision(3) << ",\"ts\":" << (event.start - origin) / 1000.0
+            << ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+        }
+    }
+    out << "\n]}" << endl;
+    return out.good();
+}
+
+// Description of one field of a record: its header name, the member that stores it,
+// and its column width and number of decimals when displayed in a table
+template <typename Record, typename T>
+struct Field {
+    const char* name;
+    T Record::* member;
+    int width;
+    int precision;
+    using Type = T;
+};
+
+// Schema of a phone record, in csv column order
+// The parser, the table output and the column storage below are all generated from this list,
+// so adding a column only means adding a member to Phone and a line here
+constexpr auto phoneSchema = make_tuple(
+    Field<Phone, string>{"Brand", &Phone::brand, 15, 0},
+    Field<Phone, string>{"Model", &Phone::model, 35, 0},
+    Field<Phone, int>{"Release Year", &Phone::releaseYear, 15, 0},
+    Field<Phone, float>{"Price", &Phone::price, 15, 2},
+    Field<Phone, float>{"Screen Size", &Phone::screenSize, 10, 2}
+);
+
+// Bit masks of the columns of the phone schema (bit i is field i), used to track which columns are decoded
+constexpr unsigned BRAND_COLUMN = 1u << 0;
+constexpr unsigned MODEL_COLUMN = 1u << 1;
+constexpr unsigned RELEASE_YEAR_COLUMN = 1u << 2;
+constexpr unsigned PRICE_COLUMN = 1u << 3;
+constexpr unsigned SCREEN_SIZE_COLUMN = 1u << 4;
+constexpr unsigned ALL_COLUMNS = (1u << tuple_size_v<decay_t<decltype(phoneSchema)>>) - 1;
+
+// Bitmasks of the commas, newlines and quotes in a block of 64 bytes: bit i is set if byte i matches
+struct CharMasks {
+    uint64_t comma;
+    uint64_t newline;
+    uint64_t quote;
+};
+
+// Function to classify 64 bytes at once with the widest vector instructions available
+CharMasks classifyBlock(const char* p) {
+    CharMasks masks;
+#if defined(__AVX2__)
+    __m256i lo = _mm256_loadu_si256((const __m256i*) p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*) (p + 32));
+    auto match = [&](char c) {
+        __m256i needle = _mm256_set1_epi8(c);
+        uint64_t low = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+        uint64_t high = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+        return low | high << 32;
+    };
+#elif defined(__SSE2__)
+    __m128i chunks[4];
+    for (int i = 0; i < 4; i++) {
+        chunks[i] = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+    }
+    auto match = [&](char c) {
+        __m128i needle = _mm_set1_epi8(c);
+        uint64_t result = 0;
+        for (int i = 0; i < 4; i++) {
+            result |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], needle)) << (16 * i);
+        }
+        return result;
+    };
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t chunks[4];
+    for (int i = 0; i < 4; i++) {
+        chunks[i] = vld1q_u8((const uint8_t*) p + 16 * i);
+    }
+    // NEON has no movemask: keep one bit per byte and add neighbouring bytes together until 64 bits remain
+    const uint8_t bitValues[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bitMask = vld1q_u8(bitValues);
+    auto match = [&](char c) {
+        uint8x16_t needle = vdupq_n_u8((uint8_t) c);
+        uint8x16_t m0 = vandq_u8(vceqq_u8(chunks[0], needle), bitMask);
+        uint8x16_t m1 = vandq_u8(vceqq_u8(chunks[1], needle), bitMask);
+        uint8x16_t m2 = vandq_u8(vceqq_u8(chunks[2], needle), bitMask);
+        uint8x16_t m3 = vandq_u8(vceqq_u8(chunks[3], needle), bitMask);
+        uint8x16_t sum = vpaddq_u8(vpaddq_u8(m0, m1), vpaddq_u8(m2, m3));
+        sum = vpaddq_u8(sum, sum);
+        return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+    };
+#else
+    auto match = [&](char c) {
+        uint64_t result = 0;
+        for (int i = 0; i < 64; i++) {
+            result |= (uint64_t) (p[i] == c) << i;
+        }
+        return result;
+    };
+#endif
+    masks.comma = match(',');
+    masks.newline = match('\n');
+    masks.quote = match('"');
+    return masks;
+}
+
+// Function to turn the quote bits into a mask of the bytes between an opening and a closing quote
+// Each bit of the result is the xor of all quote bits up to it, so it is set inside quotes
+uint64_t prefixXor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// Marks a field end in the output of scanStructure as the end of a row
+const uint32_t ROW_END = 0x80000000u;
+
+// Function to find the commas and newlines that end csv fields, 64 bytes at a time
+// Commas and newlines between quotes are part of the field and are skipped
+// The position of every field end is appended to ends; the ends of rows have the ROW_END bit set
+void scanStructure(const char* data, size_t size, vector<uint32_t>& ends) {
+    ends.reserve(ends.size() + size / 8);
+    uint64_t insideQuote = 0;
+    for (size_t base = 0; base < size; base += 64) {
+        CharMasks masks;
+        if (size - base >= 64) {
+            masks = classifyBlock(data + base);
+        } else {
+            char last[64] = {};
+            memcpy(last, data + base, size - base);
+            masks = classifyBlock(last);
+        }
+
+        uint64_t quoted = prefixXor(masks.quote) ^ insideQuote;
+        // Carry the quote state into the next block: all ones if this block ends inside quotes
+        insideQuote = (uint64_t) ((int64_t) quoted >> 63);
+
+        uint64_t structural = (masks.comma | masks.newline) & ~quoted;
+        while (structural) {
+            int bit = __builtin_ctzll(structural);
+            uint32_t end = (uint32_t) (base + bit);
+            if ((masks.newline >> bit) & 1) {
+                end |= ROW_END;
+            }
+            ends.push_back(end);
+            structural &= structural - 1;
+        }
+    }
+}
+
+// Start and end of the text of one csv field
+struct FieldSpan {
+    const char* begin;
+    const char* end;
+};
+
+// Function to store the text of a csv field in value
+// Quoted fields have their quotes removed and "" turned into "
+void unquoteField(FieldSpan span, string& value) {
+    if (span.end - span.begin >= 2 && *span.begin == '"' && span.end[-1] == '"') {
+        value.clear();
+        for (const char* c = span.begin + 1; c < span.end - 1; c++) {
+            value += *c;
+            if (*c == '"' && c + 1 < span.end - 1 && c[1] == '"') {
+                c++;
+            }
+        }
+    } else {
+        value.assign(span.begin, span.end);
+    }
+}
+
+// Function to convert the text of one csv field and store it in the record
+// Numbers that cannot be converted throw invalid_argument like stoi
+template <typename Record, typename T>
+void convertField(FieldSpan span, const Field<Record, T>& field, Record& r) {
+    if constexpr (is_same_v<T, string>) {
+        unquoteField(span, r.*field.member);
+    } else {
+        // Numbers are copied so the converter stops at the end of the field
+        char text[64];
+        size_t length = min<size_t>(span.end - span.begin, sizeof(text) - 1);
+        memcpy(text, span.begin, length);
+        text[length] = '\0';
+        const char* start = text;
+        if (*start == '"') {
+            start++;
+        }
+        char* converted = nullptr;
+        if constexpr (is_integral_v<T>) {
+            r.*field.member = (T) strtol(start, &converted, 10);
+        } else {
+            r.*field.member = (T) strtod(start, &converted);
+        }
+        if (converted == start) {
+            throw invalid_argument(string("Invalid value for ") + field.name);
+        }
+    }
+}
+
+// Function to convert the fields of one csv row into a record, one field of the schema after another
+// The fields are expanded at compile time, so there is no loop over the schema at run time
+template <const auto& Schema, typename Record>
+void convertRecord(const FieldSpan* fields, size_t fieldCount, Record& r) {
+    constexpr size_t schemaSize = tuple_size_v<decay_t<decltype(Schema)>>;
+    if (fieldCount < schemaSize) {
+        throw invalid_argument("Missing fields in csv row");
+    }
+    [&]<size_t... I>(index_sequence<I...>) {
+        (convertField(fields[I], get<I>(Schema), r), ...);
+    }(make_index_sequence<schemaSize>());
+}
+
+// Function to convert only the fields of one csv row whose bit is set in columns
+template <const auto& Schema, typename Record>
+void convertColumns(const FieldSpan* fields, unsigned columns, Record& r) {
+    constexpr size_t schemaSize = tuple_size_v<decay_t<decltype(Schema)>>;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ((columns & (1u << I) ? convertField(fields[I], get<I>(Schema), r) : void()), ...);
+    }(make_index_sequence<schemaSize>());
+}
+
+// Scratch space reused between calls of the csv row parser
+struct CsvScratch {
+    vector<uint32_t> ends;
+    vector<FieldSpan> fields;
+};
+
+// Function to split every complete csv row in data into fields and pass them to onRow
+// Returns the number of bytes used; an unfinished last row is left for the next call unless atEnd is set
+template <typename OnRow>
+size_t forEachCsvRow(const char* data, size_t size, bool atEnd, CsvScratch& scratch, OnRow onRow) {
+    vector<FieldSpan>& fields = scratch.fields;
+    size_t fieldStart = 0;
+    size_t rowStart = 0;
+    fields.clear();
+
+    auto finishRow = [&](size_t rowEnd) {
+        const char* end = data + rowEnd;
+        if (end > data + fieldStart && end[-1] == '\r') {
+            end--;
+        }
+        fields.push_back({data + fieldStart, end});
+        // Empty lines are skipped
+        if (fields.size() > 1 || end > data + fieldStart) {
+            onRow(fields);
+        }
+        fields.clear();
+        fieldStart = rowStart = rowEnd + 1;
+    };
+
+    scratch.ends.clear();
+    scanStructure(data, size, scratch.ends);
+    for (uint32_t end : scratch.ends) {
+        size_t position = end & ~ROW_END;
+        if (end & ROW_END) {
+            finishRow(position);
+        } else {
+            fields.push_back({data + fieldStart, data + position});
+            fieldStart = position + 1;
+        }
+    }
+    if (atEnd && rowStart < size) {
+        finishRow(size);
+    }
+    return min(rowStart, size);
+}
+
+// Function to parse every complete csv row in data into a record of the schema and pass it to onRecord
+// Returns the number of bytes used, like forEachCsvRow
+template <const auto& Schema, typename Record, typename OnRecord>
+size_t parseCsvRows(const char* data, size_t size, bool atEnd, CsvScratch& scratch, OnRecord onRecord) {
+    return forEachCsvRow(data, size, atEnd, scratch, [&](const vector<FieldSpan>& fields) {
+        Record r;
+        convertRecord<Schema>(fields.data(), fields.size(), r);
+        onRecord(r);
+    });
+}
+
+// Function to parse a line of csv data into a record
+template <const auto& Schema, typename Record>
+void parseRecord(const string& line, Record& r) {
+    CsvScratch scratch;
+    bool parsed = false;
+    parseCsvRows<Schema, Record>(line.data(), line.size(), true, scratch, [&](const Record& parsedRecord) {
+        if (!parsed) {
+            r = parsedRecord;
+            parsed = true;
+        }
+    });
+    if (!parsed) {
+        throw invalid_argument("Empty csv row");
+    }
+}
+
+// Function to display one field of a record with the width and precision from the schema
+template <typename Record, typename T>
+void renderField(ostream& out, const Field<Record, T>& field, const Record& r) {
+    out << setw(field.width);
+    if constexpr (is_floating_point_v<T>) {
+        out << fixed << setprecision(field.precision);
+    }
+    out << r.*field.member;
+}
+
+// Function to display one record as a table row
+// Without endLine more columns can be added to the row by the caller; columns selects the fields by bit
+template <const auto& Schema, typename Record>
+void renderRecord(ostream& out, const Record& r, bool endLine = true, unsigned columns = ~0u) {
+    out << left;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ((columns & (1u << I) ? renderField(out, get<I>(Schema), r) : void()), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    if (endLine) {
+        out << endl;
+    }
+}
+
+// Function to display the table header of a schema
+template <const auto& Schema>
+void renderHeader(ostream& out, bool endLine = true, unsigned columns = ~0u) {
+    out << left;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ((columns & (1u << I) ? void(out << setw(get<I>(Schema).width) << get<I>(Schema).name) : void()), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    if (endLine) {
+        out << endl;
+    }
+}
+
+// Column storage for a schema: one vector per field, e.g. tuple<vector<string>, ..., vector<float>>
+template <typename Record, typename... T>
+tuple<vector<T>...> columnsOf(const tuple<Field<Record, T>...>&);
+
+template <const auto& Schema>
+using ColumnsFor = decltype(columnsOf(Schema));
+
+// Function to copy the given records into column storage, one column after another
+template <const auto& Schema, typename Record>
+ColumnsFor<Schema> gatherColumns(const vector<Record>& records, const vector<int>& rowIds) {
+    ColumnsFor<Schema> columns;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            auto& column = get<I>(columns);
+            auto member = get<I>(Schema).member;
+            column.reserve(rowIds.size());
+            for (int i : rowIds) {
+                column.push_back(records[i].*member);
+            }
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    return columns;
+}
+
+// Function to display data of one phone in formatted form
+void displayPhone(const Phone& p) {
+    renderRecord<phoneSchema>(cout, p);
+}
+
+// Function to display the header of the phone table
+void displayPhoneHeader() {
+    renderHeader<phoneSchema>(cout);
+}
+
+// Function to parse a line of csv data and store it in a Phone object
+void parsePhone(const string& line, Phone& p) {
+    parseRecord<phoneSchema>(line, p);
+}
+
+// Mergeable sketch of the distribution of a column (KLL sketch) used to estimate quantiles in bounded memory
+// Level h holds values that each stand for 2^h original values; a full level is sorted and every
+// other value (starting at a random offset) is promoted to the next level
+struct QuantileSketch {
+    size_t k = 400;
+    vector<vector<float>> levels;
+    unsigned long long count = 0;
+    // NaN values (strtod accepts "nan") have no place in the order, so they are only counted
+    unsigned long long nanCount = 0;
+    float minValue = 0;
+    float maxValue = 0;
+    uint32_t randomState = 2463534242u;
+
+    // Function to return how many values a level may hold before it is compacted
+    // Lower levels get geometrically smaller capacities, the top level gets k
+    size_t levelCapacity(size_t level) const {
+        size_t depth = levels.size() - 1 - level;
+        double capacity = k;
+        for (size_t d = 0; d < depth; d++) {
+            capacity *= 2.0 / 3.0;
+        }
+        return max<size_t>(8, (size_t) capacity);
+    }
+
+    // Function to return a random bit (xorshift), used to pick which half of a level is promoted
+    int randomBit() {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return randomState & 1;
+    }
+
+    // Function to compact every level that is over its capacity
+    void compress() {
+        for (size_t h = 0; h < levels.size(); h++) {
+            if (levels[h].size() < levelCapacity(h)) {
+                continue;
+            }
+            if (h + 1 == levels.size()) {
+                levels.emplace_back();
+            }
+            vector<float>& level = levels[h];
+            sort(level.begin(), level.end());
+            // With an odd number of values the last one stays on this level, so no weight is lost
+            float kept = level.back();
+            bool odd = level.size() % 2 == 1;
+            size_t pairs = level.size() / 2 * 2;
+            for (size_t i = randomBit(); i < pairs; i += 2) {
+                levels[h + 1].push_back(level[i]);
+            }
+            level.clear();
+            if (odd) {
+                level.push_back(kept);
+            }
+        }
+    }
+
+    void add(float value) {
+        if (isnan(value)) {
+            nanCount++;
+            return;
+        }
+        if (levels.empty()) {
+            levels.emplace_back();
+            minValue = maxValue = value;
+        }
+        minValue = min(minValue, value);
+        maxValue = max(maxValue, value);
+        count++;
+        levels[0].push_back(value);
+        if (levels[0].size() >= levelCapacity(0)) {
+            compress();
+        }
+    }
+
+    // Function to combine another sketch into this one, e.g. the sketch of another shard or thread
+    void merge(const QuantileSketch& other) {
+        nanCount += other.nanCount;
+        if (other.count == 0) {
+            return;
+        }
+        if (count == 0) {
+            minValue = other.minValue;
+            maxValue = other.maxValue;
+        }
+        while (levels.size() < other.levels.size()) {
+            levels.emplace_back();
+        }
+        for (size_t h = 0; h < other.levels.size(); h++) {
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        }
+        minValue = min(minValue, other.minValue);
+        maxValue = max(maxValue, other.maxValue);
+        count += other.count;
+        compress();
+    }
+
+    // Function to estimate the value below which the fraction q of the values fall (0 <= q <= 1)
+    float quantile(double q) const {
+        if (count == 0) {
+            return 0;
+        }
+        vector<pair<float, unsigned long long>> weighted;
+        unsigned long long totalWeight = 0;
+        for (size_t h = 0; h < levels.size(); h++) {
+            for (float value : levels[h]) {
+                weighted.push_back({value, 1ULL << h});
+                totalWeight += 1ULL << h;
+            }
+        }
+        sort(weighted.begin(), weighted.end());
+
+        double target = q * totalWeight;
+        unsigned long long seen = 0;
+        for (const auto& item : weighted) {
+            seen += item.second;
+            if (seen >= target) {
+                return item.first;
+            }
+        }
+        return maxValue;
+    }
+};
+
+// Histogram with a fixed number of equally wide buckets between low and high
+// Values outside the range and NaN values are counted separately, so two histograms with the same range can be merged
+struct Histogram {
+    float low;
+    float high;
+    vector<unsigned long long> buckets;
+    unsigned long long below = 0;
+    unsigned long long above = 0;
+    unsigned long long nan = 0;
+
+    Histogram(float low, float high, int bucketCount) : low(low), high(high), buckets(bucketCount, 0) {}
+
+    void add(float value) {
+        if (isnan(value)) {
+            nan++;
+        } else if (value < low) {
+            below++;
+        } else if (value >= high) {
+            above++;
+        } else {
+            // Rounding can put a value just below high at index buckets.size()
+            size_t bucket = (size_t) ((value - low) / (high - low) * buckets.size());
+            buckets[min(bucket, buckets.size() - 1)]++;
+        }
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t b = 0; b < buckets.size(); b++) {
+            buckets[b] += other.buckets[b];
+        }
+        below += other.below;
+        above += other.above;
+        nan += other.nan;
+    }
+};
+
+// Structure to store the quantile sketch and histogram of one column
+struct ColumnStats {
+    QuantileSketch quantiles;
+    Histogram histogram;
+
+    ColumnStats(float low, float high, int bucketCount) : histogram(low, high, bucketCount) {}
+
+    void add(float value) {
+        quantiles.add(value);
+        histogram.add(value);
+    }
+
+    void merge(const ColumnStats& other) {
+        quantiles.merge(other.quantiles);
+        histogram.merge(other.histogram);
+    }
+};
+
+// Structure to store the statistics of the numeric columns, built while the phones are loaded
+struct PhoneStats {
+    ColumnStats price{0, 2000, 20};
+    ColumnStats screenSize{3, 8, 10};
+    ColumnStats releaseYear{1990, 2030, 8};
+
+    void add(const Phone& p) {
+        price.add(p.price);
+        screenSize.add(p.screenSize);
+        releaseYear.add(p.releaseYear);
+    }
+
+    void merge(const PhoneStats& other) {
+        price.merge(other.price);
+        screenSize.merge(other.screenSize);
+        releaseYear.merge(other.releaseYear);
+    }
+};
+
+// Function to display the quantiles and histogram of one column
+void displayColumnStats(const string& name, const ColumnStats& stats, int precision) {
+    const QuantileSketch& q = stats.quantiles;
+    cout << "\n----" << name << "----" << endl;
+    if (q.nanCount > 0) {
+        cout << "Not a number: " << q.nanCount << endl;
+    }
+    if (q.count == 0) {
+        cout << "No data" << endl;
+        return;
+    }
+    cout << fixed << setprecision(precision)
+    << "Count: " << q.count
+    << "  Min: " << q.minValue
+    << "  Median: " << q.quantile(0.5)
+    << "  P90: " << q.quantile(0.9)
+    << "  P95: " << q.quantile(0.95)
+    << "  P99: " << q.quantile(0.99)
+    << "  Max: " << q.maxValue << endl;
+
+    const Histogram& h = stats.histogram;
+    unsigned long long largest = max(h.below, h.above);
+    for (unsigned long long bucket : h.buckets) {
+        largest = max(largest, bucket);
+    }
+    auto bar = [&](const string& label, unsigned long long bucket) {
+        int width = largest == 0 ? 0 : (int) (40 * bucket / largest);
+        cout << left << setw(20) << label << right << setw(10) << bucket << "  " << string(width, '#') << left << endl;
+    };
+
+    float width = (h.high - h.low) / h.buckets.size();
+    stringstream label;
+    label << fixed << setprecision(precision);
+    label << "< " << h.low;
+    bar(label.str(), h.below);
+    for (size_t b = 0; b < h.buckets.size(); b++) {
+        label.str("");
+        label << "[" << h.low + b * width << ", " << h.low + (b + 1) * width << ")";
+        bar(label.str(), h.buckets[b]);
+    }
+    label.str("");
+    label << ">= " << h.high;
+    bar(label.str(), h.above);
+}
+
+// Function to display the statistics of price, screen size and release year
+void displayPhoneStats(const PhoneStats& stats) {
+    displayColumnStats("Price", stats.price, 2);
+    displayColumnStats("Screen Size", stats.screenSize, 2);
+    displayColumnStats("Release Year", stats.releaseYear, 0);
+}
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring submission and completion rings, used to keep several file reads in flight
+struct IoUring {
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*) MAP_FAILED;
+    size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    // Function to create the rings; returns false if the kernel does not support io_uring
+    bool init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+        cqRing = singleMap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*) mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* sq = (char*) sqRing;
+        char* cq = (char*) cqRing;
+        sqTail = (unsigned*) (sq + params.sq_off.tail);
+        sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*) (sq + params.sq_off.array);
+        cqHead = (unsigned*) (cq + params.cq_off.head);
+        cqTail = (unsigned*) (cq + params.cq_off.tail);
+        cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Function to queue a read of len bytes at offset into buffer and submit it to the kernel
+    bool submitRead(int fileFd, char* buffer, unsigned len, off_t offset, uint64_t userData) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fileFd;
+        sqe->addr = (uint64_t) buffer;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        return syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) == 1;
+    }
+
+    // Function to wait for the next completed read; returns false if waiting failed
+    bool waitCompletion(uint64_t& userData, int& result) {
+        while (true) {
+            unsigned head = *cqHead;
+            if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes[head & *cqMask];
+                userData = cqe->user_data;
+                result = cqe->res;
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    ~IoUring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (fd >= 0) close(fd);
+    }
+};
+#endif
+
+// Function to read exactly len bytes at offset unless the end of the file is reached
+// Returns the number of bytes read, or -1 on error
+long readFully(int fd, char* buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buffer + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Function to write all of len bytes at offset; returns false on error
+bool writeFully(int fd, const char* buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buffer + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Reader that returns a file as a sequence of large blocks while the next blocks are still being read
+// With io_uring up to depth reads are in flight in the kernel; without it a background thread reads ahead
+// with pread. Either way the caller parses one block while the following ones are loading.
+struct AsyncFileReader {
+    int fd = -1;
+    size_t fileSize = 0;
+    size_t blockSize;
+    size_t blockCount = 0;
+    unsigned depth;
+    vector<vector<char>> buffers;
+    vector<long> blockBytes;
+    // Index of the block handed out by the last call to nextBlock
+    size_t current = 0;
+    bool started = false;
+    // Set when a block could not be read, so the end of the blocks is not the end of the file
+    bool readError = false;
+
+#ifdef HAVE_IO_URING
+    IoUring ring;
+    bool useRing = false;
+    vector<bool> completed;
+#endif
+
+    // State shared with the read-ahead thread: slot i holds block readyBlock[i] once filled
+    thread readAhead;
+    mutex lock;
+    condition_variable changed;
+    vector<long long> readyBlock;
+    size_t consumed = 0;
+    bool stopping = false;
+
+    AsyncFileReader(const string& filename, size_t blockSize = 1 << 20, unsigned depth = 4)
+        : blockSize(blockSize), depth(depth), buffers(depth, vector<char>(blockSize)), blockBytes(depth, 0) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            fileSize = info.st_size;
+        }
+        blockCount = (fileSize + blockSize - 1) / blockSize;
+
+#ifdef HAVE_IO_URING
+        useRing = ring.init(depth);
+        if (useRing) {
+            completed.assign(depth, false);
+            size_t submitted = 0;
+            while (submitted < min<size_t>(depth, blockCount) && submitBlock(submitted)) {
+                submitted++;
+            }
+            if (submitted == min<size_t>(depth, blockCount)) {
+                return;
+            }
+            // Reads that are already queued finish into the buffers before the fallback overwrites them
+            drainRing(submitted);
+        }
+#endif
+        readyBlock.assign(depth, -1);
+        readAhead = thread(&AsyncFileReader::readAheadLoop, this);
+    }
+
+    AsyncFileReader(const AsyncFileReader&) = delete;
+    AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+    ~AsyncFileReader() {
+        if (readAhead.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            changed.notify_all();
+            readAhead.join();
+        }
+#ifdef HAVE_IO_URING
+        if (useRing) {
+            size_t first = started ? current : 0;
+            size_t inFlight = 0;
+            for (size_t b = first; b < min(blockCount, first + depth); b++) {
+                if (!completed[b % depth]) {
+                    inFlight++;
+                }
+            }
+            drainRing(inFlight);
+        }
+#endif
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // Function to check whether nextBlock stopped because of a read error rather than at the end of the file
+    bool failed() const {
+        return readError;
+    }
+
+    // Function to name the backend in use, for diagnostics
+    string backendName() const {
+#ifdef HAVE_IO_URING
+        if (useRing) {
+            return "io_uring";
+        }
+#endif
+        return "pread";
+    }
+
+    // Function to get the next block of the file; returns false at the end of the file or on a read error
+    // The block stays valid until the next call
+    bool nextBlock(const char*& data, size_t& size) {
+        if (started) {
+            releaseBlock(current);
+            current++;
+        }
+        started = true;
+        if (current >= blockCount) {
+            return false;
+        }
+
+        size_t slot = current % depth;
+        long bytes;
+#ifdef HAVE_IO_URING
+        if (useRing) {
+            while (!completed[slot]) {
+                uint64_t userData;
+                int result;
+                if (!ring.waitCompletion(userData, result)) {
+                    readError = true;
+                    return false;
+                }
+                size_t doneSlot = userData % depth;
+                completed[doneSlot] = true;
+                blockBytes[doneSlot] = result;
+                // A short read before the end of the file is finished with pread
+                size_t expected = min(blockSize, fileSize - userData * blockSize);
+                if (result >= 0 && (size_t) result < expected) {
+                    long rest = readFully(fd, buffers[doneSlot].data() + result, expected - result, userData * blockSize + result);
+                    blockBytes[doneSlot] = rest < 0 ? -1 : result + rest;
+                }
+            }
+            bytes = blockBytes[slot];
+        } else
+#endif
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]() { return readyBlock[slot] == (long long) current; });
+            bytes = blockBytes[slot];
+        }
+
+        // A block shorter than expected means the file shrank while it was read
+        if (bytes < 0 || (size_t) bytes != min(blockSize, fileSize - current * blockSize)) {
+            readError = true;
+            return false;
+        }
+        data = buffers[slot].data();
+        size = bytes;
+        return true;
+    }
+
+private:
+    // Function to reuse the slot of a block the caller is done with for the block depth positions later
+    void releaseBlock(size_t block) {
+#ifdef HAVE_IO_URING
+        if (useRing) {
+            completed[block % depth] = false;
+            if (block + depth < blockCount && !submitBlock(block + depth)) {
+                blockBytes[block % depth] = -1;
+                completed[block % depth] = true;
+            }
+            return;
+        }
+#endif
+        {
+            lock_guard<mutex> guard(lock);
+            consumed = block + 1;
+        }
+        changed.notify_all();
+    }
+
+#ifdef HAVE_IO_URING
+    bool submitBlock(size_t block) {
+        size_t length = min(blockSize, fileSize - block * blockSize);
+        return ring.submitRead(fd, buffers[block % depth].data(), length, block * blockSize, block);
+    }
+
+    // Function to wait for the reads still in flight, so no buffer is written after it is released
+    void drainRing(size_t inFlight) {
+        uint64_t userData;
+        int result;
+        while (inFlight > 0 && ring.waitCompletion(userData, result)) {
+            completed[userData % depth] = true;
+            inFlight--;
+        }
+        useRing = false;
+    }
+#endif
+
+    // Function run by the read-ahead thread: fills each free slot with the next block using pread
+    void readAheadLoop() {
+        for (size_t block = 0; block < blockCount; block++) {
+            size_t slot = block % depth;
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() { return stopping || block < consumed + depth; });
+                if (stopping) {
+                    return;
+                }
+            }
+            long bytes = readFully(fd, buffers[slot].data(), min(blockSize, fileSize - block * blockSize), block * blockSize);
+            {
+                lock_guard<mutex> guard(lock);
+                blockBytes[slot] = bytes;
+                readyBlock[slot] = block;
+            }
+            changed.notify_all();
+        }
+    }
+};
+
+// Function to read a csv file and pass the fields of every row to onRow
+// The file is read in large blocks by an AsyncFileReader, so rows are parsed while later blocks load,
+// and each block is tokenized with the vectorized csv scanner.
+// Returns false, after reporting the error, if the file cannot be opened or a block cannot be read; after a
+// read error the unfinished last row is not parsed, but the rows before it have been passed to onRow
+template <typename OnRow>
+bool readCsvFile(const string& filename, OnRow onRow) {
+    TraceSpan span("read csv file");
+    AsyncFileReader reader(filename);
+    if (!reader.isOpen()) {
+        cout << "Error opening file" << endl;
+        return false;
+    }
+    // A row can be split between two blocks, so the unfinished end of a block is kept in pending
+    string pending;
+    CsvScratch scratch;
+    const char* data;
+    size_t size;
+    while (reader.nextBlock(data, size)) {
+        TraceSpan blockSpan("parse block");
+        pending.append(data, size);
+        size_t used = forEachCsvRow(pending.data(), pending.size(), false, scratch, onRow);
+        pending.erase(0, used);
+    }
+    if (reader.failed()) {
+        cout << "Error reading file" << endl;
+        return false;
+    }
+    forEachCsvRow(pending.data(), pending.size(), true, scratch, onRow);
+    return true;
+}
+
+// Function to load phone data from a csv file and store it in a vector of Phone objects
+// If stats is given, the statistics of the loaded phones are added to it in the same pass (it must start empty)
+// A file that cannot be read completely adds no phones, and false is returned
+bool loadPhones(const string &filename, vector<Phone>& phones, PhoneStats* stats = nullptr) {
+    TraceSpan span("load phones");
+    size_t firstRow = phones.size();
+    bool loaded = readCsvFile(filename, [&](const vector<FieldSpan>& fields) {
+        Phone p;
+        convertRecord<phoneSchema>(fields.data(), fields.size(), p);
+        if (stats) {
+            stats->add(p);
+        }
+        phones.push_back(p);
+    });
+    if(loaded){
+        dataVersion++;
+    }
+    else {
+        phones.resize(firstRow);
+        if (stats) {
+            *stats = PhoneStats();
+        }
+    }
+    return loaded;
+}
+
+// Raw text of a lazily loaded file and where each field of each row starts in it
+// Row r has fields + 1 offsets: the start of every field, then one past the end of the last field,
+// so field i spans offsets[i] up to the separator before offsets[i + 1]
+struct LazyColumns {
+    string text;
+    vector<uint64_t> offsets;
+    // Columns not decoded yet, and whether the statistics still have to be built
+    unsigned pendingColumns = 0;
+    bool statsPending = false;
+
+    // Function to return the text of one field of a row of the shard
+    FieldSpan field(size_t row, size_t column) const {
+        constexpr size_t stride = tuple_size_v<decay_t<decltype(phoneSchema)>> + 1;
+        const uint64_t* rowOffsets = offsets.data() + row * stride;
+        return {text.data() + rowOffsets[column], text.data() + rowOffsets[column + 1] - 1};
+    }
+};
+
+// Function to index a csv file for lazy loading: the file is kept as text and only the field offsets
+// of every row are stored, nothing is converted. One empty phone is added per row; its columns are
+// filled in later by materializeColumns. Returns false, without adding phones, if the file cannot be read
+bool indexPhones(const string& filename, vector<Phone>& phones, LazyColumns& lazy) {
+    TraceSpan span("index phones");
+    constexpr size_t schemaSize = tuple_size_v<decay_t<decltype(phoneSchema)>>;
+    AsyncFileReader reader(filename);
+    if (!reader.isOpen()) {
+        cout << "Error opening file" << endl;
+        return false;
+    }
+    lazy.text.reserve(reader.fileSize);
+    size_t rows = 0;
+    auto indexRow = [&](const vector<FieldSpan>& fields) {
+        if (fields.size() < schemaSize) {
+            throw invalid_argument("Missing fields in csv row");
+        }
+        const char* base = lazy.text.data();
+        for (size_t i = 0; i < schemaSize; i++) {
+            lazy.offsets.push_back(fields[i].begin - base);
+        }
+        lazy.offsets.push_back(fields[schemaSize - 1].end - base + 1);
+        rows++;
+    };
+
+    // The blocks are appended to the text and only the rows not indexed yet are scanned
+    CsvScratch scratch;
+    size_t indexed = 0;
+    const char* data;
+    size_t size;
+    while (reader.nextBlock(data, size)) {
+        lazy.text.append(data, size);
+        indexed += forEachCsvRow(lazy.text.data() + indexed, lazy.text.size() - indexed, false, scratch, indexRow);
+    }
+    if (reader.failed()) {
+        cout << "Error reading file" << endl;
+        lazy = LazyColumns();
+        return false;
+    }
+    forEachCsvRow(lazy.text.data() + indexed, lazy.text.size() - indexed, true, scratch, indexRow);
+
+    lazy.pendingColumns = ALL_COLUMNS;
+    lazy.statsPending = true;
+    phones.resize(phones.size() + rows);
+    dataVersion++;
+    return true;
+}
+
+// Directory of a shard whose rows are stored grouped by brand (see clusterShardsByBrand)
+// brands maps every brand to its rows [begin, end) in the phones vector, and fileOrder[i] is the row
+// where the i-th row of the file is stored, so the file order can still be listed
+struct BrandClusters {
+    map<string, pair<size_t, size_t>> brands;
+    vector<int> fileOrder;
+
+    bool clustered() const {
+        return !fileOrder.empty();
+    }
+};
+
+// Structure to describe one shard of the data: the file it was loaded from and its rows in the vector
+// A shard keeps its offset when more shards are added, so row indexes stay stable
+// A lazily loaded shard also keeps its text until all of its columns are decoded
+struct Shard {
+    string source;
+    size_t offset = 0;
+    size_t count = 0;
+    PhoneStats stats = {};
+    LazyColumns lazy = {};
+    BrandClusters clusters = {};
+};
+
+// Function to check whether a file name matches a wildcard pattern with * and ?
+bool matchesWildcard(const string& pattern, const string& name) {
+    size_t p = 0, n = 0;
+    size_t starPattern = string::npos, starName = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starPattern = p++;
+            starName = n;
+        } else if (starPattern != string::npos) {
+            p = starPattern + 1;
+            n = ++starName;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+// Function to turn a data source into a sorted list of csv files
+// The source may be a single file, a directory (all .csv files in it) or a wildcard pattern such as data/*.csv
+vector<string> resolveDataSources(const string& source) {
+    namespace fs = std::filesystem;
+    vector<string> files;
+    fs::path path(source);
+    error_code error;
+
+    if (fs::is_directory(path, error)) {
+        for (const auto& entry : fs::directory_iterator(path, error)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".csv") {
+                files.push_back(entry.path().string());
+            }
+        }
+    } else if (source.find_first_of("*?") != string::npos) {
+        fs::path directory = path.parent_path().empty() ? fs::path(".") : path.parent_path();
+        string pattern = path.filename().string();
+        for (const auto& entry : fs::directory_iterator(directory, error)) {
+            if (entry.is_regular_file() && matchesWildcard(pattern, entry.path().filename().string())) {
+                files.push_back(entry.path().string());
+            }
+        }
+    } else {
+        files.push_back(source);
+    }
+
+    sort(files.begin(), files.end());
+    return files;
+}
+
+// Settings of the shared thread pool, set from the command line before the pool is first used
+struct ThreadPoolConfig {
+    // Number of workers, 0 for one per hardware thread
+    unsigned threads = 0;
+    // Pin worker i to cpu i (Linux only)
+    bool pinned = false;
+};
+
+ThreadPoolConfig threadPoolConfig;
+
+// Tasks submitted together so they can be waited for; the first exception thrown by one of them is kept
+struct TaskGroup {
+    atomic<size_t> pending = 0;
+    mutex errorLock;
+    exception_ptr error;
+};
+
+// Work-stealing thread pool shared by every parallel loading and query loop of the program
+// Every worker has its own deque: it runs the newest task at the back of its own deque and, when that is
+// empty, steals the oldest task from the front of another deque. Threads waiting for a task group run
+// tasks too, so a task may submit more tasks and wait for them without blocking a worker
+struct ThreadPool {
+    struct Task {
+        function<void()> run;
+        TaskGroup* group;
+    };
+
+    struct WorkerQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    // Tasks in all deques; sleeping threads are woken through wake when it changes or a group finishes
+    atomic<size_t> queued = 0;
+    atomic<size_t> nextQueue = 0;
+    mutex sleepLock;
+    condition_variable wake;
+    bool stopping = false;
+
+    // Index of the worker running on this thread, -1 on threads outside the pool
+    static inline thread_local int workerIndex = -1;
+
+    explicit ThreadPool(const ThreadPoolConfig& config) {
+        unsigned count = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+        for (unsigned i = 0; i < count; i++) {
+            queues.push_back(make_unique<WorkerQueue>());
+        }
+        for (unsigned i = 0; i < count; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+#if defined(__linux__)
+            if (config.pinned) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % max(1u, thread::hardware_concurrency()), &cpus);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpus), &cpus);
+            }
+#endif
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned size() const {
+        return workers.size();
+    }
+
+    // Function to add a task to the group; a worker adds it to its own deque, other threads spread
+    // their tasks over the deques in turn
+    void submit(TaskGroup& group, function<void()> run) {
+        group.pending++;
+        size_t q = workerIndex >= 0 ? workerIndex : nextQueue++ % queues.size();
+        {
+            lock_guard<mutex> guard(queues[q]->lock);
+            queues[q]->tasks.push_back({move(run), &group});
+            queued++;
+        }
+        notify();
+    }
+
+    // Function to wake every sleeping thread; taking the lock first makes sure no thread is between
+    // checking its condition and going to sleep
+    void notify() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+        }
+        wake.notify_all();
+    }
+
+    // Function to take the next task: the newest task of the own deque, or else the oldest of another deque
+    bool takeTask(Task& task) {
+        size_t own = workerIndex >= 0 ? workerIndex : nextQueue % queues.size();
+        for (size_t i = 0; i < queues.size(); i++) {
+            WorkerQueue& queue = *queues[(own + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0 && workerIndex >= 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void runTask(Task& task) {
+        TraceSpan span("pool task");
+        try {
+            task.run();
+        } catch (...) {
+            lock_guard<mutex> guard(task.group->errorLock);
+            if (!task.group->error) {
+                task.group->error = current_exception();
+            }
+        }
+        if (--task.group->pending == 0) {
+            notify();
+        }
+    }
+
+    void workerLoop(unsigned index) {
+        workerIndex = index;
+        Tracer::threadName = "pool worker";
+        while (true) {
+            Task task;
+            if (takeTask(task)) {
+                runTask(task);
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [&]() { return stopping || queued > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    // Function to wait until every task of the group has run, running queued tasks in the meantime
+    // Throws the first exception thrown by a task of the group
+    void wait(TaskGroup& group) {
+        while (group.pending > 0) {
+            Task task;
+            if (takeTask(task)) {
+                runTask(task);
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [&]() { return group.pending == 0 || queued > 0; });
+        }
+        if (group.error) {
+            rethrow_exception(group.error);
+        }
+    }
+};
+
+// Function to return the shared thread pool, started on first use with threadPoolConfig
+ThreadPool& threadPool() {
+    static ThreadPool pool(threadPoolConfig);
+    return pool;
+}
+
+// Function to run body(i) for i = 0 to taskCount - 1 on the shared thread pool and wait for all of them
+// A single task runs directly on the calling thread
+template <typename Body>
+void parallelFor(size_t taskCount, Body body) {
+    if (taskCount <= 1) {
+        if (taskCount == 1) {
+            body(0);
+        }
+        return;
+    }
+    ThreadPool& pool = threadPool();
+    TaskGroup group;
+    for (size_t i = 0; i < taskCount; i++) {
+        pool.submit(group, [&body, i]() { body(i); });
+    }
+    pool.wait(group);
+}
+
+// Number of rows in a morsel, the unit of work the parallel row loops are split into
+const size_t MORSEL_ROWS = 16384;
+
+// Which phone to keep when the same brand and model are loaded more than once
+enum class DedupPolicy { KeepAll, KeepFirst, KeepLatest, KeepCheapest };
+
+// Hash and equality of the (brand, model) key of a phone, given by its index in the phones vector
+// Indexes stay valid when the vector grows, so the set of kept phones can be reused for every new shard
+struct PhoneKeyHash {
+    const vector<Phone>* phones;
+    size_t operator()(int row) const {
+        const Phone& p = (*phones)[row];
+        size_t h = hash<string>()(p.brand);
+        return h ^ (hash<string>()(p.model) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    }
+};
+
+struct PhoneKeyEqual {
+    const vector<Phone>* phones;
+    bool operator()(int a, int b) const {
+        const Phone& p = (*phones)[a];
+        const Phone& q = (*phones)[b];
+        return p.brand == q.brand && p.model == q.model;
+    }
+};
+
+// State of load-time deduplication: the policy, the row kept for every (brand, model) and how many rows were dropped
+struct Deduplicator {
+    DedupPolicy policy;
+    unordered_set<int, PhoneKeyHash, PhoneKeyEqual> kept;
+    size_t removed = 0;
+
+    Deduplicator(DedupPolicy policy, const vector<Phone>& phones)
+        : policy(policy), kept(0, PhoneKeyHash{&phones}, PhoneKeyEqual{&phones}) {}
+
+    // Function to check whether the candidate row should replace the current row with the same key
+    bool prefer(const vector<Phone>& phones, int candidate, int current) const {
+        switch (policy) {
+            case DedupPolicy::KeepLatest: return candidate > current;
+            case DedupPolicy::KeepCheapest:
+                return phones[candidate].price != phones[current].price
+                       ? phones[candidate].price < phones[current].price : candidate < current;
+            default: return candidate < current;
+        }
+    }
+};
+
+// Function to remove repeated (brand, model) rows from the shards starting at firstShard
+// Phase one runs in parallel: every chunk of new rows keeps only its own best row per key.
+// Phase two merges the chunk winners in order into the set of kept rows. When a new row beats a row
+// of an older shard, the older row is overwritten in place, so the row indexes of older shards stay stable.
+// Returns the number of rows removed
+size_t deduplicateShards(vector<Phone>& phones, vector<Shard>& shards, size_t firstShard, Deduplicator& dedup) {
+    TraceSpan span("deduplicate");
+    if (firstShard >= shards.size()) {
+        return 0;
+    }
+    size_t first = shards[firstShard].offset;
+    size_t newRows = phones.size() - first;
+    // Chunks are larger than morsels, every chunk builds its own hash set of winners
+    size_t chunkCount = max<size_t>(1, min<size_t>(threadPool().size(), newRows / 65536 + 1));
+
+    using KeySet = unordered_set<int, PhoneKeyHash, PhoneKeyEqual>;
+    vector<KeySet> chunkWinners;
+    for (size_t t = 0; t < chunkCount; t++) {
+        chunkWinners.emplace_back(0, PhoneKeyHash{&phones}, PhoneKeyEqual{&phones});
+    }
+    parallelFor(chunkCount, [&](size_t t) {
+        KeySet& winners = chunkWinners[t];
+        for (size_t i = first + newRows * t / chunkCount; i < first + newRows * (t + 1) / chunkCount; i++) {
+            auto [found, inserted] = winners.insert(i);
+            if (!inserted && dedup.prefer(phones, i, *found)) {
+                winners.erase(found);
+                winners.insert(i);
+            }
+        }
+    });
+
+    vector<bool> keep(newRows, false);
+    vector<bool> changedShard(shards.size(), false);
+    for (const KeySet& winners : chunkWinners) {
+        for (int row : winners) {
+            auto found = dedup.kept.find(row);
+            if (found == dedup.kept.end()) {
+                dedup.kept.insert(row);
+                keep[row - first] = true;
+            } else if (dedup.prefer(phones, row, *found)) {
+                size_t current = *found;
+                if (current < first) {
+                    phones[current] = phones[row];
+                    for (size_t s = 0; s < firstShard; s++) {
+                        if (current >= shards[s].offset && current < shards[s].offset + shards[s].count) {
+                            changedShard[s] = true;
+                        }
+                    }
+                } else {
+                    keep[current - first] = false;
+                    dedup.kept.erase(found);
+                    dedup.kept.insert(row);
+                    keep[row - first] = true;
+                }
+            }
+        }
+    }
+
+    // Move the kept new rows together; their entries in the set are re-added under their new indexes
+    for (size_t i = 0; i < newRows; i++) {
+        if (keep[i]) {
+            dedup.kept.erase(first + i);
+        }
+    }
+    // The field offsets of lazily loaded shards move with their rows, so a later decode still reads the right rows
+    size_t removed = 0;
+    size_t write = first;
+    constexpr size_t stride = tuple_size_v<decay_t<decltype(phoneSchema)>> + 1;
+    for (size_t s = firstShard; s < shards.size(); s++) {
+        size_t shardStart = write;
+        vector<uint64_t>& offsets = shards[s].lazy.offsets;
+        for (size_t i = shards[s].offset; i < shards[s].offset + shards[s].count; i++) {
+            if (keep[i - first]) {
+                if (write != i) {
+                    phones[write] = move(phones[i]);
+                }
+                if (!offsets.empty()) {
+                    copy_n(offsets.begin() + (i - shards[s].offset) * stride, stride,
+                           offsets.begin() + (write - shardStart) * stride);
+                }
+                write++;
+            } else {
+                removed++;
+            }
+        }
+        if (!offsets.empty()) {
+            offsets.resize((write - shardStart) * stride);
+        }
+        changedShard[s] = shards[s].count != write - shardStart;
+        shards[s].offset = shardStart;
+        shards[s].count = write - shardStart;
+    }
+    phones.resize(write);
+    for (size_t i = first; i < write; i++) {
+        dedup.kept.insert(i);
+    }
+
+    // The statistics of shards that lost or changed rows are rebuilt from the rows that remain;
+    // a lazily loaded shard then no longer has statistics pending, or materializeStats would count its rows twice
+    parallelFor(shards.size(), [&](size_t s) {
+        if (changedShard[s]) {
+            shards[s].stats = PhoneStats();
+            for (size_t i = shards[s].offset; i < shards[s].offset + shards[s].count; i++) {
+                shards[s].stats.add(phones[i]);
+            }
+            shards[s].lazy.statsPending = false;
+            if (shards[s].lazy.pendingColumns == 0) {
+                shards[s].lazy = LazyColumns();
+            }
+        }
+    });
+
+    dedup.removed += removed;
+    if (removed > 0) {
+        dataVersion++;
+    }
+    return removed;
+}
+
+// Function to run work on every shard, one pool task per shard when there is more than one
+// scan(shardIndex) must only write to the result slot of its own shard; the caller merges the results
+template <typename Scan>
+void forEachShard(const vector<Shard>& shards, Scan scan) {
+    parallelFor(shards.size(), scan);
+}
+
+// Function to split the rows of every shard into morsels of at most MORSEL_ROWS rows, in row order
+// A morsel never spans two shards; queries scan the morsels in parallel and merge their results in order
+// With skipClustered the shards stored grouped by brand are left out, for brand queries that use their directory
+vector<pair<size_t, size_t>> shardMorsels(const vector<Shard>& shards, bool skipClustered = false) {
+    vector<pair<size_t, size_t>> morsels;
+    for (const Shard& shard : shards) {
+        if (skipClustered && shard.clusters.clustered()) {
+            continue;
+        }
+        for (size_t begin = shard.offset; begin < shard.offset + shard.count; begin += MORSEL_ROWS) {
+            morsels.push_back({begin, min(begin + MORSEL_ROWS, shard.offset + shard.count)});
+        }
+    }
+    return morsels;
+}
+
+// Function to decode the given columns of one lazily loaded shard if it does not have them yet
+// The columns are decoded in bulk for the whole shard; a shard whose columns are all decoded drops its text and offsets
+void materializeShardColumns(vector<Phone>& phones, Shard& shard, unsigned columns) {
+    LazyColumns& lazy = shard.lazy;
+    unsigned missing = lazy.pendingColumns & columns;
+    if (missing == 0) {
+        return;
+    }
+    constexpr size_t schemaSize = tuple_size_v<decay_t<decltype(phoneSchema)>>;
+    FieldSpan fields[schemaSize];
+    for (size_t row = 0; row < shard.count; row++) {
+        for (size_t c = 0; c < schemaSize; c++) {
+            if (missing & (1u << c)) {
+                fields[c] = lazy.field(row, c);
+            }
+        }
+        convertColumns<phoneSchema>(fields, missing, phones[shard.offset + row]);
+    }
+    lazy.pendingColumns &= ~missing;
+    if (lazy.pendingColumns == 0 && !lazy.statsPending) {
+        lazy = LazyColumns();
+    }
+}
+
+// Function to decode the given columns of every lazily loaded shard that does not have them yet, one thread per shard
+void materializeColumns(vector<Phone>& phones, vector<Shard>& shards, unsigned columns) {
+    TraceSpan span("decode columns");
+    forEachShard(shards, [&](size_t s) {
+        materializeShardColumns(phones, shards[s], columns);
+    });
+}
+
+// Function to build the statistics of lazily loaded shards, decoding the numeric columns they need
+void materializeStats(vector<Phone>& phones, vector<Shard>& shards) {
+    TraceSpan span("build shard stats");
+    materializeColumns(phones, shards, RELEASE_YEAR_COLUMN | PRICE_COLUMN | SCREEN_SIZE_COLUMN);
+    forEachShard(shards, [&](size_t s) {
+        LazyColumns& lazy = shards[s].lazy;
+        if (!lazy.statsPending) {
+            return;
+        }
+        for (size_t i = shards[s].offset; i < shards[s].offset + shards[s].count; i++) {
+            shards[s].stats.add(phones[i]);
+        }
+        lazy.statsPending = false;
+        if (lazy.pendingColumns == 0) {
+            lazy = LazyColumns();
+        }
+    });
+}
+
+// Function to add one shard to the end of the phones vector
+// Only the new file is read; existing shards and their row indexes are not touched
+// (with deduplication an older row can be overwritten in place by a better row of the new file)
+// With lazy set the file is only indexed, see indexPhones
+// Returns false, without adding a shard, if the file cannot be read
+bool addShard(const string& filename, vector<Phone>& phones, vector<Shard>& shards, Deduplicator* dedup = nullptr,
+              bool lazy = false) {
+    vector<Phone> shardPhones;
+    PhoneStats stats;
+    LazyColumns columns;
+    bool loaded = lazy ? indexPhones(filename, shardPhones, columns) : loadPhones(filename, shardPhones, &stats);
+    if (!loaded) {
+        return false;
+    }
+    shards.push_back({filename, phones.size(), shardPhones.size(), stats, move(columns), BrandClusters()});
+    phones.insert(phones.end(), make_move_iterator(shardPhones.begin()), make_move_iterator(shardPhones.end()));
+    if (dedup && dedup->policy != DedupPolicy::KeepAll) {
+        materializeColumns(phones, shards, ALL_COLUMNS);
+        deduplicateShards(phones, shards, shards.size() - 1, *dedup);
+    }
+    return true;
+}
+
+// Function to load several csv files in parallel, each into its own shard
+// The shards are appended to the phones vector in file order, so the row indexes do not depend on thread timing
+// With lazy set the files are only indexed, see indexPhones. A file that cannot be read adds no shard
+void loadPhoneShards(const vector<string>& files, vector<Phone>& phones, vector<Shard>& shards, Deduplicator* dedup = nullptr,
+                     bool lazy = false) {
+    size_t firstShard = shards.size();
+    vector<vector<Phone>> shardPhones(files.size());
+    vector<PhoneStats> shardStats(files.size());
+    vector<LazyColumns> shardColumns(files.size());
+    // One byte per file rather than vector<bool>, so the tasks do not share words
+    vector<char> loaded(files.size());
+    // Every file is one task, the parsing of a file follows its sequential reads
+    parallelFor(files.size(), [&](size_t i) {
+        loaded[i] = lazy ? indexPhones(files[i], shardPhones[i], shardColumns[i])
+                         : loadPhones(files[i], shardPhones[i], &shardStats[i]);
+    });
+
+    size_t total = phones.size();
+    for (const vector<Phone>& part : shardPhones) {
+        total += part.size();
+    }
+    phones.reserve(total);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!loaded[i]) {
+            continue;
+        }
+        shards.push_back({files[i], phones.size(), shardPhones[i].size(), move(shardStats[i]), move(shardColumns[i]), BrandClusters()});
+        phones.insert(phones.end(), make_move_iterator(shardPhones[i].begin()), make_move_iterator(shardPhones[i].end()));
+    }
+    if (dedup && dedup->policy != DedupPolicy::KeepAll) {
+        // Deduplication compares and moves whole rows, so every column has to be decoded first
+        materializeColumns(phones, shards, ALL_COLUMNS);
+        deduplicateShards(phones, shards, firstShard, *dedup);
+    }
+}
+
+// Function to store the rows of every shard from firstShard on grouped by brand, brands in name order and
+// rows of a brand in file order, and to build the brand directory of the shard. A brand filter then reads
+// one slice of the vector per shard and a brand count is the length of the slices.
+// Rows only move within their shard, so offsets stay valid; the offsets of lazily loaded text and the
+// dedup index are moved with the rows. Must run after deduplication of the shards
+void clusterShardsByBrand(vector<Phone>& phones, vector<Shard>& shards, size_t firstShard, Deduplicator* dedup = nullptr) {
+    TraceSpan span("cluster by brand");
+    materializeColumns(phones, shards, BRAND_COLUMN);
+    if (dedup && dedup->policy != DedupPolicy::KeepAll) {
+        // The dedup index hashes the row contents, so the rows are taken out while they move
+        for (size_t s = firstShard; s < shards.size(); s++) {
+            for (size_t i = shards[s].offset; i < shards[s].offset + shards[s].count; i++) {
+                dedup->kept.erase(i);
+            }
+        }
+    }
+
+    parallelFor(shards.size() - min(firstShard, shards.size()), [&](size_t t) {
+        Shard& shard = shards[firstShard + t];
+        BrandClusters& clusters = shard.clusters;
+        clusters = BrandClusters();
+        if (shard.count == 0) {
+            return;
+        }
+
+        // Count the rows of every brand, then give every row its place after the brands before it
+        vector<int> brandOf(shard.count);
+        vector<string_view> names;
+        unordered_map<string_view, int> ids;
+        for (size_t i = 0; i < shard.count; i++) {
+            auto [found, inserted] = ids.try_emplace(phones[shard.offset + i].brand, (int) names.size());
+            if (inserted) {
+                names.push_back(found->first);
+            }
+            brandOf[i] = found->second;
+        }
+        vector<int> byName(names.size());
+        for (size_t b = 0; b < names.size(); b++) {
+            byName[b] = b;
+        }
+        sort(byName.begin(), byName.end(), [&](int a, int b) { return names[a] < names[b]; });
+        vector<size_t> next(names.size(), 0);
+        for (int b : brandOf) {
+            next[b]++;
+        }
+        size_t begin = shard.offset;
+        for (int b : byName) {
+            size_t count = next[b];
+            clusters.brands[string(names[b])] = {begin, begin + count};
+            next[b] = begin;
+            begin += count;
+        }
+        clusters.fileOrder.resize(shard.count);
+        for (size_t i = 0; i < shard.count; i++) {
+            clusters.fileOrder[i] = next[brandOf[i]]++;
+        }
+
+        // Move the rows, and the field offsets of rows whose text is not decoded yet
+        vector<Phone> moved(shard.count);
+        for (size_t i = 0; i < shard.count; i++) {
+            moved[clusters.fileOrder[i] - shard.offset] = move(phones[shard.offset + i]);
+        }
+        move(moved.begin(), moved.end(), phones.begin() + shard.offset);
+        if (!shard.lazy.offsets.empty()) {
+            constexpr size_t stride = tuple_size_v<decay_t<decltype(phoneSchema)>> + 1;
+            vector<uint64_t> offsets(shard.lazy.offsets.size());
+            for (size_t i = 0; i < shard.count; i++) {
+                copy_n(shard.lazy.offsets.begin() + i * stride, stride,
+                       offsets.begin() + (clusters.fileOrder[i] - shard.offset) * stride);
+            }
+            shard.lazy.offsets = move(offsets);
+        }
+    });
+
+    if (dedup && dedup->policy != DedupPolicy::KeepAll) {
+        for (size_t s = firstShard; s < shards.size(); s++) {
+            for (size_t i = shards[s].offset; i < shards[s].offset + shards[s].count; i++) {
+                dedup->kept.insert(i);
+            }
+        }
+    }
+    dataVersion++;
+}
+
+// Function to return the indexes of all phones in the order of their files
+// Clustered shards give their rows through the file order permutation, other shards are already in file order
+vector<int> rowsInFileOrder(const vector<Shard>& shards) {
+    vector<int> rows;
+    for (const Shard& shard : shards) {
+        if (shard.clusters.clustered()) {
+            rows.insert(rows.end(), shard.clusters.fileOrder.begin(), shard.clusters.fileOrder.end());
+        } else {
+            for (size_t i = shard.offset; i < shard.offset + shard.count; i++) {
+                rows.push_back(i);
+            }
+        }
+    }
+    return rows;
+}
+
+// Function to check whether any shard is stored grouped by brand
+bool anyShardClustered(const vector<Shard>& shards) {
+    return any_of(shards.begin(), shards.end(), [](const Shard& shard) { return shard.clusters.clustered(); });
+}
+
+// Function to combine the statistics of all shards
+PhoneStats mergeShardStats(const vector<Shard>& shards) {
+    PhoneStats stats;
+    for (const Shard& shard : shards) {
+        stats.merge(shard.stats);
+    }
+    return stats;
+}
+
+// Structure to store the result of a query in compact form
+// List queries store the indexes of the matching phones, aggregate queries store the aggregated values
+struct QueryResult {
+    vector<int> rowIds;
+    map<string, int> counts;
+};
+
+// Bounded cache of query results with least recently used eviction
+// Entries are keyed on the query text and the data version, and are dropped when the data changes
+// Results are shared, so a cursor can keep using a result after it has been evicted
+struct QueryCache {
+    size_t capacity;
+    unsigned long long version = 0;
+    // Most recently used entries are at the front of the list
+    list<pair<string, shared_ptr<const QueryResult>>> entries;
+    unordered_map<string, list<pair<string, shared_ptr<const QueryResult>>>::iterator> index;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    unsigned long long invalidations = 0;
+
+    explicit QueryCache(size_t capacity) : capacity(capacity) {}
+
+    // Function to drop all entries computed on an older version of the data
+    void invalidateIfStale() {
+        if (version != dataVersion) {
+            invalidations += entries.size();
+            entries.clear();
+            index.clear();
+            version = dataVersion;
+        }
+    }
+
+    // Function to return the cached result of a query, computing and storing it on a miss
+    template <typename Compute>
+    shared_ptr<const QueryResult> get(const string& kind, const string& argument, Compute compute) {
+        TraceSpan span("cached query");
+        invalidateIfStale();
+        string key = normalizeKey(kind, argument);
+
+        auto found = index.find(key);
+        if (found != index.end()) {
+            hits++;
+            entries.splice(entries.begin(), entries, found->second);
+            return found->second->second;
+        }
+
+        misses++;
+        entries.emplace_front(key, make_shared<const QueryResult>(compute()));
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+            evictions++;
+        }
+        return entries.front().second;
+    }
+
+    // Function to build the cache key: lower case query kind, the argument and the data version
+    string normalizeKey(const string& kind, const string& argument) const {
+        string key;
+        for (unsigned char c : kind) {
+            key += (char) tolower(c);
+        }
+        key += '\x1f';
+        key += argument;
+        key += '\x1f';
+        key += to_string(version);
+        return key;
+    }
+
+    // Function to display the hit and miss counters of the cache
+    void displayStats() const {
+        unsigned long long lookups = hits + misses;
+        cout << "\n----Query cache statistics----" << endl;
+        cout << "Entries: " << entries.size() << " / " << capacity << endl;
+        cout << "Hits: " << hits << endl;
+        cout << "Misses: " << misses << endl;
+        cout << "Hit rate: " << fixed << setprecision(2)
+        << (lookups == 0 ? 0.0 : 100.0 * hits / lookups) << "%" << endl;
+        cout << "Evictions: " << evictions << endl;
+        cout << "Invalidated by data changes: " << invalidations << endl;
+    }
+};
+
+// Cursor over the rows of a query result
+// It shares the list of indexes with the cache instead of copying it, and rows are only
+// formatted when a page is displayed, so opening a cursor costs the same for any result size
+struct ResultCursor {
+    // Without a result the cursor goes over all phones in vector order
+    shared_ptr<const QueryResult> result;
+    size_t total = 0;
+    size_t position = 0;
+
+    explicit ResultCursor(size_t allRows) : total(allRows) {}
+    explicit ResultCursor(shared_ptr<const QueryResult> result) : result(result), total(result->rowIds.size()) {}
+
+    int rowAt(size_t i) const {
+        return result ? result->rowIds[i] : (int) i;
+    }
+};
+
+// Text columns displayed after the phone columns, e.g. the columns of a csv file joined to the phones
+struct ExtraColumns {
+    vector<string> names;
+    function<const vector<string>&(int)> valuesOf;
+};
+
+// Function to display the rows [offset, offset + limit) of a cursor with a formatted header
+void displayPage(const vector<Phone>& phones, const ResultCursor& cursor, size_t offset, size_t limit,
+                 const ExtraColumns* extra = nullptr) {
+    TraceSpan span("render page");
+    if (extra) {
+        renderHeader<phoneSchema>(cout, false);
+        for (const string& name : extra->names) {
+            cout << " " << setw(14) << name;
+        }
+        cout << endl;
+    } else {
+        displayPhoneHeader();
+    }
+
+    size_t end = offset + min(limit, cursor.total - min(offset, cursor.total));
+    for (size_t i = offset; i < end; i++) {
+        int row = cursor.rowAt(i);
+        if (extra) {
+            renderRecord<phoneSchema>(cout, phones[row], false);
+            for (const string& value : extra->valuesOf(row)) {
+                cout << " " << setw(14) << value;
+            }
+            cout << endl;
+        } else {
+            displayPhone(phones[row]);
+        }
+    }
+}
+
+// Function to page through a cursor from the menu: next, previous, jump to a page or quit
+// Results that fit on one page are displayed without asking
+void browseResults(const vector<Phone>& phones, ResultCursor& cursor, size_t pageSize = 20,
+                   const ExtraColumns* extra = nullptr) {
+    size_t pages = max<size_t>(1, (cursor.total + pageSize - 1) / pageSize);
+    while (true) {
+        displayPage(phones, cursor, cursor.position, pageSize, extra);
+        if (pages == 1) {
+            return;
+        }
+
+        size_t page = cursor.position / pageSize;
+        cout << "\nPage " << page + 1 << " of " << pages << " (rows " << cursor.position + 1 << "-"
+        << min(cursor.position + pageSize, cursor.total) << " of " << cursor.total << ")" << endl;
+        cout << "n. Next page  p. Previous page  j. Jump to page  q. Back to menu: ";
+        string input;
+        if (!getline(cin, input) || input == "q") {
+            return;
+        }
+        if (input == "n" || input.empty()) {
+            if (page + 1 < pages) {
+                cursor.position += pageSize;
+            }
+        } else if (input == "p") {
+            if (page > 0) {
+                cursor.position -= pageSize;
+            }
+        } else if (input == "j") {
+            cout << "Enter page number: ";
+            getline(cin, input);
+            try {
+                size_t target = stoul(input);
+                if (target >= 1 && target <= pages) {
+                    cursor.position = (target - 1) * pageSize;
+                } else {
+                    cout << "Invalid page" << endl;
+                }
+            } catch (const exception&) {
+                cout << "Invalid page" << endl;
+            }
+        } else {
+            cout << "Invalid choice" << endl;
+        }
+    }
+}
+
+// Function to display all phones from the vector with a formatted header, one page at a time
+// Phones stored grouped by brand are displayed in the order of their files
+void displayAllPhones(const vector<Phone>& phones, const vector<Shard>& shards) {
+    if (anyShardClustered(shards)) {
+        auto result = make_shared<QueryResult>();
+        result->rowIds = rowsInFileOrder(shards);
+        ResultCursor cursor(result);
+        browseResults(phones, cursor);
+        return;
+    }
+    ResultCursor cursor(phones.size());
+    browseResults(phones, cursor);
+}
+
+// Function to search for a phone by model and return its index in the vector
+// Returns -1 if not found 
+int searchPhoneByModel(const vector<Phone>& phones, const string& model) {
+    TraceSpan span("search by model");
+    for (int i = 0; i < phones.size(); i++) {
+        if (phones[i].model == model) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to count the number of phones of each brand
+// Returns a map with brand as key and the number of phones with that brand as value
+// Each morsel of rows is counted separately on the thread pool and the counts are merged afterwards;
+// shards stored grouped by brand are not scanned, their counts are the lengths of the brand ranges
+map<string, int> countPhonesByBrand(const vector<Phone>& phones, const vector<Shard>& shards) {
+    TraceSpan span("count by brand");
+    vector<pair<size_t, size_t>> morsels = shardMorsels(shards, true);
+    vector<map<string, int>> morselCounts(morsels.size());
+    parallelFor(morsels.size(), [&](size_t m) {
+        for (size_t i = morsels[m].first; i < morsels[m].second; i++) {
+            morselCounts[m][phones[i].brand]++;
+        }
+    });
+
+    map<string, int> count;
+    for (const map<string, int>& morselCount : morselCounts) {
+        for (const auto& brandCount : morselCount) {
+            count[brandCount.first] += brandCount.second;
+        }
+    }
+    for (const Shard& shard : shards) {
+        for (const auto& [brand, range] : shard.clusters.brands) {
+            count[brand] += range.second - range.first;
+        }
+    }
+    return count;
+}
+
+// Function to find the phones of a particular brand and return their indexes in row order
+// Each morsel of rows is scanned separately on the thread pool; shards stored grouped by brand
+// are not scanned, their matching rows are the brand range of their directory
+vector<int> findPhonesByBrand(const vector<Phone>& phones, const vector<Shard>& shards, const string& brand) {
+    TraceSpan span("find by brand");
+    vector<pair<size_t, size_t>> morsels = shardMorsels(shards, true);
+    vector<vector<int>> morselIds(morsels.size());
+    parallelFor(morsels.size(), [&](size_t m) {
+        for (size_t i = morsels[m].first; i < morsels[m].second; i++) {
+            if (phones[i].brand == brand) {
+                morselIds[m].push_back(i);
+            }
+        }
+    });
+
+    // Morsels are in shard order, so the results are put together shard by shard
+    vector<int> rowIds;
+    size_t m = 0;
+    for (const Shard& shard : shards) {
+        if (shard.clusters.clustered()) {
+            auto found = shard.clusters.brands.find(brand);
+            if (found != shard.clusters.brands.end()) {
+                for (size_t i = found->second.first; i < found->second.second; i++) {
+                    rowIds.push_back(i);
+                }
+            }
+            continue;
+        }
+        for (; m < morsels.size() && morsels[m].first < shard.offset + shard.count; m++) {
+            rowIds.insert(rowIds.end(), morselIds[m].begin(), morselIds[m].end());
+        }
+    }
+    return rowIds;
+}
+
+// Function to find the phones of a particular brand and return a cursor over them
+// The indexes of the matching phones are cached, so repeating the same brand does not rescan the vector
+ResultCursor queryPhonesByBrand(const vector<Phone>& phones, const vector<Shard>& shards, const string& brand, QueryCache& cache) {
+    return ResultCursor(cache.get("brand", brand, [&]() {
+        QueryResult result;
+        result.rowIds = findPhonesByBrand(phones, shards, brand);
+        return result;
+    }));
+}
+
+// Function to display phones of a particular brand, one page at a time
+void displayPhonesByBrand(const vector<Phone>& phones, const vector<Shard>& shards, const string& brand, QueryCache& cache) {
+    ResultCursor cursor = queryPhonesByBrand(phones, shards, brand, cache);
+
+    if (cursor.total == 0) {
+        cout << "No phones found for brand: " << brand << endl;
+    } else {
+        cout << "\n----Phones of brand " << brand << "----" << endl;
+        browseResults(phones, cursor);
+    }
+}
+
+//Function to find the highest and lowest release year and to calculate the average release year
+//returns the average release year as an integer
+int findMaxMinAvgReleaseYear(const vector<Phone>& phones, Phone& max, Phone& min) {
+    int sum = 0;
+    int maxReleaseYear = INT_MIN;
+    int minReleaseYear = INT_MAX;
+
+    for (const Phone& p : phones) {
+        sum += p.releaseYear;
+
+        if (p.releaseYear > maxReleaseYear) {
+            maxReleaseYear = p.releaseYear;
+            max = p;
+        }
+        if (p.releaseYear < minReleaseYear) {
+            minReleaseYear = p.releaseYear;
+            min = p;
+        }
+    }
+    return sum / phones.size();
+}
+
+// Totals of the phones released in one year
+struct YearBucket {
+    unsigned long long count = 0;
+    double priceSum = 0;
+    double screenSizeSum = 0;
+    QuantileSketch prices;
+
+    void add(const Phone& p) {
+        count++;
+        priceSum += p.price;
+        screenSizeSum += p.screenSize;
+        prices.add(p.price);
+    }
+
+    void merge(const YearBucket& other) {
+        count += other.count;
+        priceSum += other.priceSum;
+        screenSizeSum += other.screenSizeSum;
+        prices.merge(other.prices);
+    }
+};
+
+// Most release years the trends table has a row for
+const long long MAX_TREND_YEARS = 200;
+
+// Buckets of consecutive release years, buckets[i] holds the phones of year firstYear + i
+// Phones released before or after the years of the buckets are only counted
+struct YearSeries {
+    int firstYear = 0;
+    vector<YearBucket> buckets;
+    unsigned long long earlier = 0;
+    unsigned long long later = 0;
+};
+
+// Function to bucket the phones by release year in one pass over the rows
+// Years fall in a small range, so the buckets are a dense array indexed by year; the range is taken from
+// the release year statistics of the shards, so it is known before the scan. Every morsel fills its own
+// array on the thread pool and the arrays are merged afterwards.
+// A few outlier years (e.g. 99999999) must not make the array huge: when the years span more than
+// MAX_TREND_YEARS, the range is cut to the 0.1% to 99.9% quantiles and at most MAX_TREND_YEARS years
+YearSeries buildYearSeries(const vector<Phone>& phones, const vector<Shard>& shards) {
+    TraceSpan span("year series");
+    YearSeries series;
+    QuantileSketch years = mergeShardStats(shards).releaseYear.quantiles;
+    if (years.count == 0) {
+        return series;
+    }
+    long long firstYear = (long long) years.minValue;
+    long long lastYear = (long long) years.maxValue;
+    if (lastYear - firstYear + 1 > MAX_TREND_YEARS) {
+        firstYear = (long long) years.quantile(0.001);
+        lastYear = min((long long) years.quantile(0.999), firstYear + MAX_TREND_YEARS - 1);
+    }
+    series.firstYear = (int) firstYear;
+    size_t yearCount = lastYear - firstYear + 1;
+
+    vector<pair<size_t, size_t>> morsels = shardMorsels(shards);
+    vector<vector<YearBucket>> morselBuckets(morsels.size());
+    vector<pair<unsigned long long, unsigned long long>> morselOutside(morsels.size());
+    parallelFor(morsels.size(), [&](size_t m) {
+        vector<YearBucket>& buckets = morselBuckets[m];
+        buckets.resize(yearCount);
+        for (size_t i = morsels[m].first; i < morsels[m].second; i++) {
+            long long year = (long long) phones[i].releaseYear - firstYear;
+            if (year < 0) {
+                morselOutside[m].first++;
+            } else if (year >= (long long) yearCount) {
+                morselOutside[m].second++;
+            } else {
+                buckets[year].add(phones[i]);
+            }
+        }
+    });
+
+    series.buckets.resize(yearCount);
+    for (size_t m = 0; m < morsels.size(); m++) {
+        for (size_t y = 0; y < yearCount; y++) {
+            series.buckets[y].merge(morselBuckets[m][y]);
+        }
+        series.earlier += morselOutside[m].first;
+        series.later += morselOutside[m].second;
+    }
+    return series;
+}
+
+// Function to format a number of the trends table with fixed decimals, or - when there is no value
+// With sign set, positive numbers get a + like year-over-year changes usually do
+string formatTrendValue(optional<double> value, int precision, bool sign = false) {
+    if (!value) {
+        return "-";
+    }
+    stringstream text;
+    if (sign) {
+        text << showpos;
+    }
+    text << fixed << setprecision(precision) << *value;
+    return text.str();
+}
+
+// Function to display per-year phone counts, average and median price and average screen size,
+// with rolling 3 and 5 year average prices and the change from the previous year
+// The rolling averages cover the last 3 or 5 years up to the row's year and weigh every phone equally;
+// they are computed from running totals of the buckets, so the report needs no second scan
+void displayYearTrends(const vector<Phone>& phones, const vector<Shard>& shards) {
+    YearSeries series = buildYearSeries(phones, shards);
+    cout << "\n----Release year trends----" << endl;
+    if (series.buckets.empty()) {
+        cout << "No data" << endl;
+        return;
+    }
+
+    // Running totals: totals[i] covers the buckets before i
+    size_t yearCount = series.buckets.size();
+    vector<unsigned long long> countTotals(yearCount + 1, 0);
+    vector<double> priceTotals(yearCount + 1, 0);
+    for (size_t y = 0; y < yearCount; y++) {
+        countTotals[y + 1] = countTotals[y] + series.buckets[y].count;
+        priceTotals[y + 1] = priceTotals[y] + series.buckets[y].priceSum;
+    }
+    auto average = [](double sum, unsigned long long count) {
+        return count == 0 ? optional<double>() : sum / count;
+    };
+    auto rollingPrice = [&](size_t y, size_t window) {
+        size_t from = y + 1 >= window ? y + 1 - window : 0;
+        return average(priceTotals[y + 1] - priceTotals[from], countTotals[y + 1] - countTotals[from]);
+    };
+
+    cout << left << setw(6) << "Year" << right << setw(8) << "Phones" << setw(12) << "Avg Price"
+    << setw(14) << "Median Price" << setw(12) << "Avg Screen" << setw(14) << "3y Avg Price"
+    << setw(14) << "5y Avg Price" << setw(12) << "YoY Phones" << setw(12) << "YoY Price" << left << endl;
+    for (size_t y = 0; y < yearCount; y++) {
+        const YearBucket& bucket = series.buckets[y];
+        optional<double> price = average(bucket.priceSum, bucket.count);
+        optional<double> yoyPhones, yoyPrice, median;
+        if (y > 0) {
+            const YearBucket& previous = series.buckets[y - 1];
+            optional<double> previousPrice = average(previous.priceSum, previous.count);
+            yoyPhones = (double) bucket.count - (double) previous.count;
+            if (price && previousPrice) {
+                yoyPrice = *price - *previousPrice;
+            }
+        }
+        if (bucket.count > 0) {
+            median = bucket.prices.quantile(0.5);
+        }
+        cout << left << setw(6) << series.firstYear + (int) y << right << setw(8) << bucket.count
+        << setw(12) << formatTrendValue(price, 2) << setw(14) << formatTrendValue(median, 2)
+        << setw(12) << formatTrendValue(average(bucket.screenSizeSum, bucket.count), 2)
+        << setw(14) << formatTrendValue(rollingPrice(y, 3), 2) << setw(14) << formatTrendValue(rollingPrice(y, 5), 2)
+        << setw(12) << formatTrendValue(yoyPhones, 0, true) << setw(12) << formatTrendValue(yoyPrice, 2, true)
+        << left << endl;
+    }
+    if (series.earlier > 0 || series.later > 0) {
+        cout << "Phones released before " << series.firstYear << ": " << series.earlier
+        << ", after " << series.firstYear + (int) yearCount - 1 << ": " << series.later << endl;
+    }
+}
+
+//Function to search for phones where the model contains a partial text and return the indexes of matching phones 
+//Each morsel of rows is searched separately on the thread pool and the indexes are joined in row order
+vector<int> searchPhoneByPartialText(const vector<Phone>& phones, const vector<Shard>& shards, const string& text) {
+    TraceSpan span("partial text search");
+    vector<pair<size_t, size_t>> morsels = shardMorsels(shards);
+    vector<vector<int>> morselMatches(morsels.size());
+    parallelFor(morsels.size(), [&](size_t m) {
+        for(size_t i = morsels[m].first; i < morsels[m].second; i++) {
+            //string::npos is returned if the text is not found in the model
+            if (phones[i].model.find(text) != string::npos) {
+                morselMatches[m].push_back(i);
+            }
+        }
+    });
+
+    vector<int> matchingPhones;
+    for (const vector<int>& matches : morselMatches) {
+        matchingPhones.insert(matchingPhones.end(), matches.begin(), matches.end());
+    }
+    return matchingPhones;
+}
+
+//Function to search for phones by partial text and return a cursor over them; the matches are cached
+ResultCursor queryPhonesByPartialText(const vector<Phone>& phones, const vector<Shard>& shards, const string& text, QueryCache& cache) {
+    return ResultCursor(cache.get("partial", text, [&]() {
+        QueryResult result;
+        result.rowIds = searchPhoneByPartialText(phones, shards, text);
+        return result;
+    }));
+}
+
+// Order of autocomplete results: alphabetical by model, highest price first or newest release year first
+enum class CompletionRank { Model, Price, Recency };
+
+// Prefix index over the model names for autocomplete
+// The rows are kept sorted by model, so the models starting with a prefix are one range found by binary
+// search. For ranked completions a segment tree per ranking holds the best position of every node, so the
+// top k of a range are found in O(k log n) without looking at the rest of the range.
+// Rows added later go to a small sorted list of recent rows that is searched as well, and are merged into
+// the main array when that list grows past an eighth of it
+struct ModelIndex {
+    // Row indexes sorted by model, ties in row order
+    vector<int> sorted;
+    // Segment trees over positions in sorted: node i covers its children 2i and 2i + 1, leaf n + p is position p
+    vector<int> bestPrice;
+    vector<int> bestYear;
+    vector<int> recent;
+    size_t indexedRows = 0;
+    bool built = false;
+
+    // Function to check whether row a is a better completion than row b for a ranking
+    static bool ranksBefore(const vector<Phone>& phones, CompletionRank rank, int a, int b) {
+        const Phone& p = phones[a];
+        const Phone& q = phones[b];
+        if (rank == CompletionRank::Price && p.price != q.price) {
+            return p.price > q.price;
+        }
+        if (rank == CompletionRank::Recency && p.releaseYear != q.releaseYear) {
+            return p.releaseYear > q.releaseYear;
+        }
+        return p.model != q.model ? p.model < q.model : a < b;
+    }
+
+    // Function to build the segment tree of a ranking over the sorted rows
+    void buildTree(const vector<Phone>& phones, CompletionRank rank, vector<int>& tree) {
+        size_t n = sorted.size();
+        tree.assign(2 * n, 0);
+        for (size_t p = 0; p < n; p++) {
+            tree[n + p] = p;
+        }
+        for (size_t i = n - 1; i > 0; i--) {
+            int left = tree[2 * i], right = tree[2 * i + 1];
+            tree[i] = ranksBefore(phones, rank, sorted[right], sorted[left]) ? right : left;
+        }
+    }
+
+    // Function to index all phones from scratch
+    void build(const vector<Phone>& phones) {
+        sorted.resize(phones.size());
+        for (size_t i = 0; i < phones.size(); i++) {
+            sorted[i] = i;
+        }
+        sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+            return ranksBefore(phones, CompletionRank::Model, a, b);
+        });
+        recent.clear();
+        if (!sorted.empty()) {
+            buildTree(phones, CompletionRank::Price, bestPrice);
+            buildTree(phones, CompletionRank::Recency, bestYear);
+        }
+        indexedRows = phones.size();
+        built = true;
+    }
+
+    // Function to index the phones added since the last update
+    // With rebuild set, or when phones were removed, older rows may have changed, so everything is rebuilt
+    void update(const vector<Phone>& phones, bool rebuild) {
+        if (rebuild || phones.size() < indexedRows) {
+            build(phones);
+            return;
+        }
+        auto byModel = [&](int a, int b) { return ranksBefore(phones, CompletionRank::Model, a, b); };
+        for (size_t i = indexedRows; i < phones.size(); i++) {
+            recent.insert(upper_bound(recent.begin(), recent.end(), (int) i, byModel), i);
+        }
+        indexedRows = phones.size();
+        if (recent.size() > max<size_t>(1024, sorted.size() / 8)) {
+            vector<int> merged(sorted.size() + recent.size());
+            merge(sorted.begin(), sorted.end(), recent.begin(), recent.end(), merged.begin(), byModel);
+            sorted.swap(merged);
+            recent.clear();
+            buildTree(phones, CompletionRank::Price, bestPrice);
+            buildTree(phones, CompletionRank::Recency, bestYear);
+        }
+    }
+
+    // Function to find the positions [first, last) of a sorted list of rows whose model starts with prefix
+    static pair<size_t, size_t> prefixRange(const vector<Phone>& phones, const vector<int>& rows, const string& prefix) {
+        auto first = partition_point(rows.begin(), rows.end(), [&](int row) {
+            return phones[row].model.compare(0, prefix.size(), prefix) < 0;
+        });
+        auto last = partition_point(first, rows.end(), [&](int row) {
+            return phones[row].model.compare(0, prefix.size(), prefix) == 0;
+        });
+        return {first - rows.begin(), last - rows.begin()};
+    }
+
+    // Function to return the best position of sorted in [first, last) according to a segment tree
+    int bestInRange(const vector<Phone>& phones, CompletionRank rank, const vector<int>& tree, size_t first, size_t last) const {
+        size_t n = sorted.size();
+        int best = -1;
+        auto consider = [&](size_t node) {
+            if (best < 0 || ranksBefore(phones, rank, sorted[tree[node]], sorted[best])) {
+                best = tree[node];
+            }
+        };
+        for (size_t l = first + n, r = last + n; l < r; l /= 2, r /= 2) {
+            if (l & 1) {
+                consider(l++);
+            }
+            if (r & 1) {
+                consider(--r);
+            }
+        }
+        return best;
+    }
+
+    // Function to return the rows of the k best phones whose model starts with prefix
+    vector<int> complete(const vector<Phone>& phones, const string& prefix, CompletionRank rank, size_t k) const {
+        vector<int> candidates;
+        auto [first, last] = prefixRange(phones, sorted, prefix);
+        if (rank == CompletionRank::Model) {
+            for (size_t p = first; p < min(last, first + k); p++) {
+                candidates.push_back(sorted[p]);
+            }
+        } else {
+            // Best-first search: every range on the heap is represented by its best position, taking a
+            // position splits its range in two
+            const vector<int>& tree = rank == CompletionRank::Price ? bestPrice : bestYear;
+            struct Range {
+                int best;
+                size_t first, last;
+            };
+            auto worse = [&](const Range& a, const Range& b) {
+                return ranksBefore(phones, rank, sorted[b.best], sorted[a.best]);
+            };
+            vector<Range> heap;
+            auto push = [&](size_t from, size_t to) {
+                if (from < to) {
+                    heap.push_back({bestInRange(phones, rank, tree, from, to), from, to});
+                    push_heap(heap.begin(), heap.end(), worse);
+                }
+            };
+            push(first, last);
+            while (!heap.empty() && candidates.size() < k) {
+                pop_heap(heap.begin(), heap.end(), worse);
+                Range range = heap.back();
+                heap.pop_back();
+                candidates.push_back(sorted[range.best]);
+                push(range.first, range.best);
+                push(range.best + 1, range.last);
+            }
+        }
+
+        auto [recentFirst, recentLast] = prefixRange(phones, recent, prefix);
+        candidates.insert(candidates.end(), recent.begin() + recentFirst, recent.begin() + recentLast);
+        sort(candidates.begin(), candidates.end(), [&](int a, int b) { return ranksBefore(phones, rank, a, b); });
+        candidates.resize(min(candidates.size(), k));
+        return candidates;
+    }
+};
+
+// Function to display the autocomplete results of a prefix and how long the lookup took
+void displayCompletions(const vector<Phone>& phones, const ModelIndex& index, const string& prefix,
+                        CompletionRank rank, size_t k) {
+    auto start = chrono::steady_clock::now();
+    vector<int> rows = index.complete(phones, prefix, rank, k);
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+    if (rows.empty()) {
+        cout << "No models start with: " << prefix << endl;
+    } else {
+        displayPhoneHeader();
+        for (int row : rows) {
+            displayPhone(phones[row]);
+        }
+    }
+    cout << rows.size() << " completions in " << elapsed.count() << " microseconds" << endl;
+}
+
+// Structure to store one fuzzy search result: the index of the phone in the vector and its edit distance
+struct FuzzyMatch {
+    int index;
+    int distance;
+};
+
+// Function to map a character to a bit of a 64-bit mask (letters and digits get their own bit)
+// Used by the fuzzy search prefilter to cheaply check which characters appear in a model
+int fuzzyCharBit(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + (c - '0');
+    return 36 + (c % 28);
+}
+
+// Function to normalize text for fuzzy search: lower case with all whitespace removed
+string normalizeForFuzzySearch(const string& text) {
+    string normalized;
+    for (unsigned char c : text) {
+        if (!isspace(c)) {
+            normalized += (char) tolower(c);
+        }
+    }
+    return normalized;
+}
+
+// The bit-parallel matcher works on one 64-bit word, so longer search texts are rejected
+const size_t MAX_FUZZY_PATTERN = 64;
+
+// Function to compute the smallest edit distance between the pattern and any part of the model
+// Uses Myers' bit-parallel algorithm, so one text character updates the whole pattern column at once
+// The pattern must already be normalized and at most MAX_FUZZY_PATTERN characters long
+int fuzzyDistance(const string& pattern, const uint64_t peq[256], const string& model) {
+    int m = (int) pattern.size();
+    uint64_t highBit = 1ULL << (m - 1);
+    uint64_t pv = ~0ULL;
+    uint64_t mv = 0;
+    int score = m;
+    int best = m;
+
+    for (unsigned char c : model) {
+        if (isspace(c)) {
+            continue;
+        }
+        uint64_t eq = peq[tolower(c)];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & highBit) {
+            score++;
+        } else if (mh & highBit) {
+            score--;
+        }
+        // The match may start anywhere in the model, so no carry is shifted into the first row
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (score < best) {
+            best = score;
+        }
+    }
+    return best;
+}
+
+// Function to search for the phones whose model is closest to the text, ignoring case and whitespace
+// Returns at most maxResults matches with an edit distance of at most maxDistance, closest first
+// A negative maxDistance means a third of the text length (at least 1), or exact matches only
+// for texts shorter than 3 characters; texts longer than MAX_FUZZY_PATTERN find nothing
+vector<FuzzyMatch> searchPhoneByFuzzyText(const vector<Phone>& phones, const string& text, size_t maxResults, int maxDistance = -1) {
+    TraceSpan span("fuzzy search");
+    vector<FuzzyMatch> matches;
+    string pattern = normalizeForFuzzySearch(text);
+    if (pattern.empty() || pattern.size() > MAX_FUZZY_PATTERN || maxResults == 0) {
+        return matches;
+    }
+    if (maxDistance < 0) {
+        maxDistance = pattern.size() < 3 ? 0 : max(1, (int) pattern.size() / 3);
+    }
+
+    // Bit i of peq[c] is set when pattern[i] == c, and patternMask has one bit per distinct character
+    uint64_t peq[256] = {};
+    uint64_t patternMask = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        unsigned char c = pattern[i];
+        peq[c] |= 1ULL << i;
+        patternMask |= 1ULL << fuzzyCharBit(c);
+    }
+
+    // Max-heap on (distance, index) so the worst of the current top results is always on top
+    auto worse = [](const FuzzyMatch& a, const FuzzyMatch& b) {
+        return a.distance != b.distance ? a.distance < b.distance : a.index < b.index;
+    };
+
+    for (size_t i = 0; i < phones.size(); i++) {
+        const string& model = phones[i].model;
+
+        // Prefilter: every distinct pattern character missing from the model costs at least one edit
+        uint64_t modelMask = 0;
+        for (unsigned char c : model) {
+            modelMask |= 1ULL << fuzzyCharBit(tolower(c));
+        }
+        int bound = matches.size() == maxResults ? min(maxDistance, matches.front().distance) : maxDistance;
+        if (__builtin_popcountll(patternMask & ~modelMask) > bound) {
+            continue;
+        }
+
+        int distance = fuzzyDistance(pattern, peq, model);
+        if (distance > maxDistance) {
+            continue;
+        }
+        if (matches.size() < maxResults) {
+            matches.push_back({(int) i, distance});
+            push_heap(matches.begin(), matches.end(), worse);
+        } else if (distance < matches.front().distance) {
+            pop_heap(matches.begin(), matches.end(), worse);
+            matches.back() = {(int) i, distance};
+            push_heap(matches.begin(), matches.end(), worse);
+        }
+    }
+
+    sort_heap(matches.begin(), matches.end(), worse);
+    return matches;
+}
+
+// Numeric columns of a phone that can be used for sorting
+enum class PhoneColumn { ReleaseYear, Price, ScreenSize };
+
+// Function to return the display name of a numeric column
+string columnName(PhoneColumn column) {
+    switch (column) {
+        case PhoneColumn::ReleaseYear: return "release year";
+        case PhoneColumn::Price: return "price";
+        default: return "screen size";
+    }
+}
+
+// Function to map a float to an unsigned integer with the same ordering
+// Positive floats get their sign bit set, negative floats have all bits flipped
+uint32_t floatSortKey(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// Function to build the order-preserving sort key of one phone for a column
+uint32_t phoneSortKey(const Phone& p, PhoneColumn column) {
+    switch (column) {
+        case PhoneColumn::ReleaseYear: return (uint32_t) p.releaseYear ^ 0x80000000u;
+        case PhoneColumn::Price: return floatSortKey(p.price);
+        default: return floatSortKey(p.screenSize);
+    }
+}
+
+// Function to radix sort (key, index) pairs packed as key << 32 | index
+// Sorts on the 32 key bits with three 11-bit passes; passes where all keys share the digit are skipped
+// The sort is stable, so equal keys keep their index order
+void radixSortPairs(uint64_t* pairs, size_t n) {
+    const int bits = 11;
+    const size_t buckets = 1 << bits;
+    vector<uint64_t> buffer(n);
+    uint64_t* from = pairs;
+    uint64_t* to = buffer.data();
+
+    for (int shift = 32; shift < 64; shift += bits) {
+        vector<size_t> count(buckets + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            count[((from[i] >> shift) & (buckets - 1)) + 1]++;
+        }
+        if (n == 0 || count[((from[0] >> shift) & (buckets - 1)) + 1] == n) {
+            continue;
+        }
+        for (size_t b = 0; b < buckets; b++) {
+            count[b + 1] += count[b];
+        }
+        for (size_t i = 0; i < n; i++) {
+            to[count[(from[i] >> shift) & (buckets - 1)]++] = from[i];
+        }
+        swap(from, to);
+    }
+    if (from != pairs) {
+        copy(from, from + n, pairs);
+    }
+}
+
+// Function to merge sorted chunks of items pairwise in parallel rounds on the thread pool
+// Chunk c holds items[bounds[c]] up to items[bounds[c + 1]]
+template <typename T, typename Less>
+void mergeSortedChunks(vector<T>& items, vector<size_t> bounds, Less less) {
+    size_t n = items.size();
+    vector<T> buffer(n);
+    while (bounds.size() > 2) {
+        vector<size_t> merged;
+        for (size_t c = 0; c + 1 < bounds.size(); c += 2) {
+            merged.push_back(bounds[c]);
+        }
+        merged.push_back(n);
+        parallelFor(merged.size() - 1, [&](size_t m) {
+            size_t c = m * 2;
+            if (c + 2 < bounds.size()) {
+                merge(items.begin() + bounds[c], items.begin() + bounds[c + 1], items.begin() + bounds[c + 1],
+                      items.begin() + bounds[c + 2], buffer.begin() + bounds[c], less);
+            } else {
+                copy(items.begin() + bounds[c], items.begin() + bounds[c + 1], buffer.begin() + bounds[c]);
+            }
+        });
+        items.swap(buffer);
+        bounds = merged;
+    }
+}
+
+// Function to sort (key, index) pairs in chunks on the thread pool
+// Each task radix sorts one chunk, then sorted chunks are merged pairwise in parallel rounds
+void parallelSortPairs(vector<uint64_t>& pairs, unsigned chunkCount) {
+    size_t n = pairs.size();
+    vector<size_t> bounds;
+    for (unsigned t = 0; t <= chunkCount; t++) {
+        bounds.push_back(n * t / chunkCount);
+    }
+
+    parallelFor(chunkCount, [&](size_t t) {
+        radixSortPairs(pairs.data() + bounds[t], bounds[t + 1] - bounds[t]);
+    });
+    mergeSortedChunks(pairs, bounds, less<uint64_t>());
+}
+
+// Function to sort the phones on a numeric column without moving the phones themselves
+// Returns the indexes of the phones in sorted order; equal keys keep their original order
+// Large inputs are sorted in parallel chunks and merged, small inputs with one radix sort
+vector<int> sortPhoneIds(const vector<Phone>& phones, PhoneColumn column, bool descending) {
+    TraceSpan span("sort");
+    const size_t parallelThreshold = 1 << 20;
+    vector<uint64_t> pairs(phones.size());
+    parallelFor((phones.size() + MORSEL_ROWS - 1) / MORSEL_ROWS, [&](size_t m) {
+        for (size_t i = m * MORSEL_ROWS; i < min(phones.size(), (m + 1) * MORSEL_ROWS); i++) {
+            uint32_t key = phoneSortKey(phones[i], column);
+            if (descending) {
+                key = ~key;
+            }
+            pairs[i] = (uint64_t) key << 32 | i;
+        }
+    });
+
+    unsigned chunkCount = threadPool().size();
+    if (pairs.size() >= parallelThreshold && chunkCount > 1) {
+        parallelSortPairs(pairs, chunkCount);
+    } else {
+        radixSortPairs(pairs.data(), pairs.size());
+    }
+
+    vector<int> sortedIds(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        sortedIds[i] = (uint32_t) pairs[i];
+    }
+    return sortedIds;
+}
+
+// Function to sort phones on a numeric column and return a cursor over them in sorted order
+// The sorted order is cached as a list of indexes, so the phones are only sorted once per data version
+ResultCursor queryPhonesSorted(const vector<Phone>& phones, PhoneColumn column, bool descending, QueryCache& cache) {
+    string order = descending ? "descending" : "ascending";
+    return ResultCursor(cache.get("sort", columnName(column) + " " + order, [&]() {
+        QueryResult result;
+        result.rowIds = sortPhoneIds(phones, column, descending);
+        return result;
+    }));
+}
+
+// Function to display phones sorted on a numeric column in either direction, one page at a time
+void displayPhonesSorted(const vector<Phone>& phones, PhoneColumn column, bool descending, QueryCache& cache) {
+    ResultCursor cursor = queryPhonesSorted(phones, column, descending, cache);
+
+    cout << "\n----Phones in " << (descending ? "descending" : "ascending") << " order of " << columnName(column) << "----" << endl;
+    browseResults(phones, cursor);
+}
+
+//Function to display phones in descending order of price
+void displayPhonesInDescendingOrder(const vector<Phone>& phones, QueryCache& cache){
+    displayPhonesSorted(phones, PhoneColumn::Price, true, cache);
+}
+
+// One column of a multi-column sort: the column bit (BRAND_COLUMN, ...) and its direction
+struct SortKey {
+    unsigned column;
+    bool descending;
+};
+
+// Normalized sort key of one row: its bytes compare with memcmp in the order of the sort specification
+// The first 8 bytes are also stored as a big-endian number, so most comparisons are one integer compare
+struct NormalizedKey {
+    uint64_t prefix;
+    const unsigned char* bytes;
+    uint32_t length;
+    uint32_t row;
+};
+
+// Function to append the normalized bytes of one sort column of a phone to key
+// Numbers are stored big-endian with the ordering of phoneSortKey. Strings are stored byte by byte with
+// 0 escaped as 0 255 and end with 0 0, so a shorter string sorts before any longer string it starts.
+// A descending column has all of its bytes inverted
+void appendNormalizedKey(vector<unsigned char>& key, const Phone& p, const SortKey& sortKey) {
+    size_t start = key.size();
+    auto appendNumber = [&](uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            key.push_back(value >> shift);
+        }
+    };
+    if (sortKey.column == BRAND_COLUMN || sortKey.column == MODEL_COLUMN) {
+        const string& text = sortKey.column == BRAND_COLUMN ? p.brand : p.model;
+        for (unsigned char c : text) {
+            key.push_back(c);
+            if (c == 0) {
+                key.push_back(255);
+            }
+        }
+        key.push_back(0);
+        key.push_back(0);
+    } else if (sortKey.column == RELEASE_YEAR_COLUMN) {
+        appendNumber(phoneSortKey(p, PhoneColumn::ReleaseYear));
+    } else if (sortKey.column == PRICE_COLUMN) {
+        appendNumber(phoneSortKey(p, PhoneColumn::Price));
+    } else {
+        appendNumber(phoneSortKey(p, PhoneColumn::ScreenSize));
+    }
+    if (sortKey.descending) {
+        for (size_t i = start; i < key.size(); i++) {
+            key[i] = ~key[i];
+        }
+    }
+}
+
+// Function to compare two normalized keys; the keys end with the row index, so no two are equal
+bool normalizedKeyLess(const NormalizedKey& a, const NormalizedKey& b) {
+    if (a.prefix != b.prefix) {
+        return a.prefix < b.prefix;
+    }
+    int order = memcmp(a.bytes, b.bytes, min(a.length, b.length));
+    return order != 0 ? order < 0 : a.length < b.length;
+}
+
+// Function to sort the phones on several columns, e.g. brand ascending, then year descending
+// Every row's key columns are encoded once into a normalized key (followed by the row index, which keeps
+// equal rows in their original order); the sort then only compares the keys and never looks at the phones.
+// Keys are built per morsel and sorted in chunks on the thread pool, then merged
+vector<int> sortPhoneIdsBy(const vector<Phone>& phones, const vector<SortKey>& sortKeys) {
+    TraceSpan span("multi-column sort");
+    size_t morselCount = (phones.size() + MORSEL_ROWS - 1) / MORSEL_ROWS;
+    vector<vector<unsigned char>> morselBytes(morselCount);
+    vector<NormalizedKey> keys(phones.size());
+    parallelFor(morselCount, [&](size_t m) {
+        size_t begin = m * MORSEL_ROWS;
+        size_t end = min(phones.size(), begin + MORSEL_ROWS);
+        vector<unsigned char>& bytes = morselBytes[m];
+        vector<size_t> starts;
+        for (size_t i = begin; i < end; i++) {
+            starts.push_back(bytes.size());
+            for (const SortKey& sortKey : sortKeys) {
+                appendNormalizedKey(bytes, phones[i], sortKey);
+            }
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                bytes.push_back(i >> shift);
+            }
+        }
+        // The bytes do not move any more, so the keys can point into them
+        starts.push_back(bytes.size());
+        for (size_t i = begin; i < end; i++) {
+            NormalizedKey& key = keys[i];
+            key.bytes = bytes.data() + starts[i - begin];
+            key.length = starts[i - begin + 1] - starts[i - begin];
+            key.row = i;
+            key.prefix = 0;
+            for (uint32_t b = 0; b < 8; b++) {
+                key.prefix = key.prefix << 8 | (b < key.length ? key.bytes[b] : 0);
+            }
+        }
+    });
+
+    unsigned chunkCount = keys.size() >= MORSEL_ROWS ? threadPool().size() : 1;
+    vector<size_t> bounds;
+    for (unsigned t = 0; t <= chunkCount; t++) {
+        bounds.push_back(keys.size() * t / chunkCount);
+    }
+    parallelFor(chunkCount, [&](size_t t) {
+        sort(keys.begin() + bounds[t], keys.begin() + bounds[t + 1], normalizedKeyLess);
+    });
+    mergeSortedChunks(keys, bounds, normalizedKeyLess);
+
+    vector<int> sortedIds(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        sortedIds[i] = keys[i].row;
+    }
+    return sortedIds;
+}
+
+// Function to sort phones on several columns and return a cursor over them; the order is cached
+ResultCursor queryPhonesOrdered(const vector<Phone>& phones, const vector<SortKey>& sortKeys, const string& specification,
+                                QueryCache& cache) {
+    return ResultCursor(cache.get("order", specification, [&]() {
+        QueryResult result;
+        result.rowIds = sortPhoneIdsBy(phones, sortKeys);
+        return result;
+    }));
+}
+
+// Function to find the n best phones of every brand on a numeric column, in one pass over the rows
+// Every morsel keeps a bounded heap of at most n rows per brand, so the pass costs O(rows log n);
+// the heaps of the morsels are then merged brand by brand. Best means highest when descending is set.
+// Returns the rows brand after brand in brand order, best first; equal values keep their row order
+vector<int> topPhonesPerBrand(const vector<Phone>& phones, const vector<Shard>& shards, PhoneColumn column,
+                              bool descending, size_t n) {
+    TraceSpan span("top per brand");
+    if (n == 0) {
+        return {};
+    }
+    // Rows are packed as key << 32 | row like in sortPhoneIds, so the best row has the smallest value
+    // and each heap is a max heap whose front is the worst row kept
+    auto keep = [n](vector<uint64_t>& heap, uint64_t entry) {
+        if (heap.size() < n) {
+            heap.push_back(entry);
+            push_heap(heap.begin(), heap.end());
+        } else if (entry < heap.front()) {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = entry;
+            push_heap(heap.begin(), heap.end());
+        }
+    };
+
+    vector<pair<size_t, size_t>> morsels = shardMorsels(shards);
+    vector<unordered_map<string_view, vector<uint64_t>>> morselHeaps(morsels.size());
+    parallelFor(morsels.size(), [&](size_t m) {
+        for (size_t i = morsels[m].first; i < morsels[m].second; i++) {
+            uint32_t key = phoneSortKey(phones[i], column);
+            if (descending) {
+                key = ~key;
+            }
+            keep(morselHeaps[m][phones[i].brand], (uint64_t) key << 32 | i);
+        }
+    });
+
+    map<string_view, vector<uint64_t>> brandHeaps;
+    for (const auto& heaps : morselHeaps) {
+        for (const auto& [brand, heap] : heaps) {
+            for (uint64_t entry : heap) {
+                keep(brandHeaps[brand], entry);
+            }
+        }
+    }
+    vector<int> rows;
+    for (auto& [brand, heap] : brandHeaps) {
+        sort_heap(heap.begin(), heap.end());
+        for (uint64_t entry : heap) {
+            rows.push_back((uint32_t) entry);
+        }
+    }
+    return rows;
+}
+
+// Function to find the n best phones of every brand and return a cursor over them; the rows are cached
+ResultCursor queryTopPhonesPerBrand(const vector<Phone>& phones, const vector<Shard>& shards, PhoneColumn column,
+                                    bool descending, size_t n, QueryCache& cache) {
+    string order = descending ? "descending" : "ascending";
+    return ResultCursor(cache.get("top", columnName(column) + " " + order + " " + to_string(n), [&]() {
+        QueryResult result;
+        result.rowIds = topPhonesPerBrand(phones, shards, column, descending, n);
+        return result;
+    }));
+}
+
+// Function to display the n highest or lowest phones of every brand on a column, one page at a time
+void displayTopPhonesPerBrand(const vector<Phone>& phones, const vector<Shard>& shards, PhoneColumn column,
+                              bool descending, size_t n, QueryCache& cache) {
+    ResultCursor cursor = queryTopPhonesPerBrand(phones, shards, column, descending, n, cache);
+
+    cout << "\n----" << (descending ? "Highest " : "Lowest ") << n << " phones per brand by " << columnName(column) << "----" << endl;
+    browseResults(phones, cursor);
+}
+
+// Sequence of values produced one at a time by a coroutine
+// The coroutine only runs when next() is called and stops at every co_yield, so a consumer that
+// stops asking also stops all the work before it
+template <typename T>
+struct Generator {
+    struct promise_type {
+        const T* current = nullptr;
+        exception_ptr error;
+
+        Generator get_return_object() {
+            return Generator(coroutine_handle<promise_type>::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        // The value stays alive in the coroutine until it is resumed, so only its address is kept
+        suspend_always yield_value(const T& value) noexcept {
+            current = addressof(value);
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            error = current_exception();
+        }
+    };
+
+    coroutine_handle<promise_type> handle;
+
+    explicit Generator(coroutine_handle<promise_type> handle) : handle(handle) {}
+    Generator(Generator&& other) noexcept : handle(exchange(other.handle, {})) {}
+    Generator(const Generator&) = delete;
+    ~Generator() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    // Function to run the coroutine up to its next value; returns false when it has finished
+    // An exception thrown inside the coroutine is thrown again here
+    bool next() {
+        handle.resume();
+        if (handle.promise().error) {
+            rethrow_exception(handle.promise().error);
+        }
+        return !handle.done();
+    }
+
+    const T& value() const {
+        return *handle.promise().current;
+    }
+};
+
+// Batch of row indexes passed between the operators of a query pipeline
+// A batch is only valid until the next batch is asked for, operators reuse their buffers
+using RowBatch = span<const int>;
+
+// Function to produce the indexes of all phones in vector order, batchSize at a time
+Generator<RowBatch> scanRows(const vector<Phone>& phones, size_t batchSize = 1024) {
+    vector<int> batch;
+    batch.reserve(batchSize);
+    for (size_t start = 0; start < phones.size(); start += batchSize) {
+        batch.clear();
+        for (size_t i = start; i < min(phones.size(), start + batchSize); i++) {
+            batch.push_back(i);
+        }
+        co_yield RowBatch(batch);
+    }
+}
+
+// Function to produce the indexes of the phones of one brand in vector order, batchSize at a time
+// Shards stored grouped by brand give the rows of their brand range without reading the phones
+Generator<RowBatch> brandRows(const vector<Phone>& phones, const vector<Shard>& shards, string brand, size_t batchSize = 1024) {
+    vector<int> batch;
+    batch.reserve(batchSize);
+    for (const Shard& shard : shards) {
+        size_t begin = shard.offset, end = shard.offset + shard.count;
+        bool wholeRange = shard.clusters.clustered();
+        if (wholeRange) {
+            auto found = shard.clusters.brands.find(brand);
+            tie(begin, end) = found != shard.clusters.brands.end() ? found->second : pair<size_t, size_t>(0, 0);
+        }
+        for (size_t i = begin; i < end; i++) {
+            if (wholeRange || phones[i].brand == brand) {
+                batch.push_back(i);
+            }
+            if (batch.size() == batchSize) {
+                co_yield RowBatch(batch);
+                batch.clear();
+            }
+        }
+    }
+    if (!batch.empty()) {
+        co_yield RowBatch(batch);
+    }
+}
+
+// Function to pass on only the rows for which keep(row) is true; empty batches are not passed on
+template <typename Keep>
+Generator<RowBatch> filterRows(Generator<RowBatch> input, Keep keep) {
+    vector<int> batch;
+    while (input.next()) {
+        batch.clear();
+        for (int row : input.value()) {
+            if (keep(row)) {
+                batch.push_back(row);
+            }
+        }
+        if (!batch.empty()) {
+            co_yield RowBatch(batch);
+        }
+    }
+}
+
+// Function to sort the rows on a numeric column, stable like sortPhoneIds
+// Sorting needs every row, so the whole input is read before the first batch is passed on
+Generator<RowBatch> sortRows(Generator<RowBatch> input, const vector<Phone>& phones, PhoneColumn column,
+                             bool descending, size_t batchSize = 1024) {
+    vector<uint64_t> pairs;
+    while (input.next()) {
+        for (int row : input.value()) {
+            uint32_t key = phoneSortKey(phones[row], column);
+            pairs.push_back((uint64_t) (descending ? ~key : key) << 32 | (uint32_t) row);
+        }
+    }
+    radixSortPairs(pairs.data(), pairs.size());
+
+    vector<int> batch;
+    batch.reserve(batchSize);
+    for (size_t start = 0; start < pairs.size(); start += batchSize) {
+        batch.clear();
+        for (size_t i = start; i < min(pairs.size(), start + batchSize); i++) {
+            batch.push_back((uint32_t) pairs[i]);
+        }
+        co_yield RowBatch(batch);
+    }
+}
+
+// Function to pass on rows that were already computed, batchSize at a time
+Generator<RowBatch> rowsOf(vector<int> rows, size_t batchSize = 1024) {
+    for (size_t start = 0; start < rows.size(); start += batchSize) {
+        co_yield RowBatch(rows).subspan(start, min(batchSize, rows.size() - start));
+    }
+}
+
+// Function to skip the first offset rows and pass on at most limit rows after them
+// Once the limit is reached the input is not asked for more, so the operators before it stop early
+Generator<RowBatch> limitRows(Generator<RowBatch> input, size_t offset, size_t limit) {
+    while (limit > 0 && input.next()) {
+        RowBatch batch = input.value();
+        size_t skipped = min(offset, batch.size());
+        offset -= skipped;
+        batch = batch.subspan(skipped);
+        batch = batch.first(min(limit, batch.size()));
+        limit -= batch.size();
+        if (!batch.empty()) {
+            co_yield batch;
+        }
+    }
+}
+
+// Function to display the rows coming out of a pipeline as a table of the selected columns (one bit per column)
+// Returns the number of rows displayed
+size_t renderRows(ostream& out, const vector<Phone>& phones, Generator<RowBatch> input, unsigned columns = ALL_COLUMNS) {
+    TraceSpan span("render rows");
+    size_t rows = 0;
+    renderHeader<phoneSchema>(out, true, columns);
+    while (input.next()) {
+        for (int row : input.value()) {
+            renderRecord<phoneSchema>(out, phones[row], true, columns);
+            rows++;
+        }
+    }
+    return rows;
+}
+
+// Rows of a second csv file keyed on the phone model, such as sales or inventory data
+// The first column is the model and the other columns are kept as text
+struct KeyedTable {
+    vector<string> keys;
+    vector<vector<string>> values;
+    size_t columnCount = 0;
+};
+
+// Function to load a keyed csv file; returns false, after reporting the error, if the file cannot be read
+bool loadKeyedTable(const string& filename, KeyedTable& table) {
+    TraceSpan span("load keyed table");
+    return readCsvFile(filename, [&](const vector<FieldSpan>& fields) {
+        table.keys.emplace_back();
+        unquoteField(fields[0], table.keys.back());
+        table.values.emplace_back(fields.size() - 1);
+        for (size_t f = 1; f < fields.size(); f++) {
+            unquoteField(fields[f], table.values.back()[f - 1]);
+        }
+        table.columnCount = max(table.columnCount, fields.size() - 1);
+    });
+}
+
+// Result of joining the phones with a keyed table: one row per (phone, keyed row) pair with the same model
+// phones holds a copy of the phone of every joined row, so the existing queries and aggregations can run on it
+struct JoinedTable {
+    vector<Phone> phones;
+    vector<Shard> shards;
+    vector<int> catalogRows;
+    vector<int> keyedRows;
+};
+
+// Function to split row indexes into partitions by the hash of their key, on the thread pool
+// Each task partitions one chunk of rows; the chunks are joined in order so partitions stay sorted
+// hashOf returns the hash of the key of a row
+template <typename HashOf>
+vector<vector<int>> partitionByHash(size_t rowCount, unsigned partitions, HashOf hashOf) {
+    size_t chunkCount = max<size_t>(1, min<size_t>(partitions, rowCount / 65536 + 1));
+    vector<vector<vector<int>>> local(chunkCount, vector<vector<int>>(partitions));
+    parallelFor(chunkCount, [&](size_t t) {
+        for (size_t i = rowCount * t / chunkCount; i < rowCount * (t + 1) / chunkCount; i++) {
+            local[t][hashOf(i) % partitions].push_back(i);
+        }
+    });
+
+    vector<vector<int>> result(partitions);
+    for (unsigned p = 0; p < partitions; p++) {
+        for (size_t t = 0; t < chunkCount; t++) {
+            result[p].insert(result[p].end(), local[t][p].begin(), local[t][p].end());
+        }
+    }
+    return result;
+}
+
+// Function to join the phones with a keyed table on the model, as a parallel partitioned hash join
+// Both sides are split into partitions by the hash of the model; for every partition one task builds a
+// hash table on the smaller side and probes it with the larger side. Joined rows are ordered by phone, then keyed row
+JoinedTable hashJoin(const vector<Phone>& phones, const KeyedTable& keyed) {
+    TraceSpan span("hash join");
+    unsigned partitions = threadPool().size();
+    auto phoneKey = [&](size_t i) { return string_view(phones[i].model); };
+    auto keyedKey = [&](size_t i) { return string_view(keyed.keys[i]); };
+    hash<string_view> hasher;
+    vector<vector<int>> phoneParts = partitionByHash(phones.size(), partitions, [&](size_t i) { return hasher(phoneKey(i)); });
+    vector<vector<int>> keyedParts = partitionByHash(keyed.keys.size(), partitions, [&](size_t i) { return hasher(keyedKey(i)); });
+    bool buildOnPhones = phones.size() <= keyed.keys.size();
+
+    // Matches are packed as phone row << 32 | keyed row
+    vector<vector<uint64_t>> partMatches(partitions);
+    parallelFor(partitions, [&](size_t p) {
+        const vector<int>& buildRows = buildOnPhones ? phoneParts[p] : keyedParts[p];
+        const vector<int>& probeRows = buildOnPhones ? keyedParts[p] : phoneParts[p];
+        unordered_map<string_view, vector<int>> table;
+        table.reserve(buildRows.size());
+        for (int row : buildRows) {
+            table[buildOnPhones ? phoneKey(row) : keyedKey(row)].push_back(row);
+        }
+        for (int row : probeRows) {
+            auto found = table.find(buildOnPhones ? keyedKey(row) : phoneKey(row));
+            if (found == table.end()) {
+                continue;
+            }
+            for (int match : found->second) {
+                uint64_t phoneRow = buildOnPhones ? match : row;
+                uint64_t keyedRow = buildOnPhones ? row : match;
+                partMatches[p].push_back(phoneRow << 32 | keyedRow);
+            }
+        }
+    });
+
+    vector<uint64_t> matches;
+    for (const vector<uint64_t>& part : partMatches) {
+        matches.insert(matches.end(), part.begin(), part.end());
+    }
+    sort(matches.begin(), matches.end());
+
+    JoinedTable joined;
+    joined.phones.reserve(matches.size());
+    Shard shard;
+    shard.source = "join";
+    for (uint64_t match : matches) {
+        joined.catalogRows.push_back(match >> 32);
+        joined.keyedRows.push_back((uint32_t) match);
+        joined.phones.push_back(phones[match >> 32]);
+        shard.stats.add(joined.phones.back());
+    }
+    shard.count = joined.phones.size();
+    joined.shards.push_back(move(shard));
+    return joined;
+}
+
+// Function to describe the keyed columns of a joined table, for display after the phone columns
+ExtraColumns joinedColumns(const JoinedTable& joined, const KeyedTable& keyed) {
+    ExtraColumns extra;
+    for (size_t c = 0; c < keyed.columnCount; c++) {
+        extra.names.push_back("Column " + to_string(c + 2));
+    }
+    extra.valuesOf = [&joined, &keyed](int row) -> const vector<string>& {
+        return keyed.values[joined.keyedRows[row]];
+    };
+    return extra;
+}
+
+// Function to hash the selected fields of a record (bit i is field i of the schema)
+// Floats are hashed by their bits, so the hash only depends on the stored values
+template <const auto& Schema, typename Record>
+uint64_t hashFields(const Record& r, unsigned columns) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            if (!(columns & (1u << I))) {
+                return;
+            }
+            const auto& value = r.*get<I>(Schema).member;
+            uint64_t v;
+            if constexpr (is_same_v<decay_t<decltype(value)>, string>) {
+                v = hash<string_view>()(value);
+            } else if constexpr (is_floating_point_v<decay_t<decltype(value)>>) {
+                v = floatSortKey(value);
+            } else {
+                v = (uint64_t) value;
+            }
+            h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    return h;
+}
+
+// Function to display the fields that differ between two versions of a record, as name: old -> new
+template <const auto& Schema, typename Record>
+void renderChangedFields(ostream& out, const Record& before, const Record& after) {
+    bool first = true;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            const auto& field = get<I>(Schema);
+            if (before.*field.member == after.*field.member) {
+                return;
+            }
+            out << (first ? "" : ", ") << field.name << ": " << fixed << setprecision(field.precision)
+            << before.*field.member << " -> " << after.*field.member;
+            first = false;
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+}
+
+// Difference between two versions of the catalog, matched on brand and model
+// When a brand and model appears several times, its rows are matched in file order
+struct CatalogDiff {
+    vector<int> added;
+    vector<int> removed;
+    // Pairs of (old row, new row) whose other fields changed
+    vector<pair<int, int>> changed;
+    size_t unchanged = 0;
+};
+
+// Function to compare an old and a new version of the catalog
+// The key (brand, model) and the content (every other field) of each row are hashed in parallel, and both
+// versions are split into partitions by the key hash. For every partition one task sorts the rows of both
+// versions on the key and walks them side by side; matched rows whose content hashes differ are changed
+CatalogDiff diffCatalogs(const vector<Phone>& before, const vector<Phone>& after) {
+    TraceSpan span("catalog diff");
+    constexpr unsigned keyColumns = BRAND_COLUMN | MODEL_COLUMN;
+    struct RowHashes {
+        uint64_t key;
+        uint64_t content;
+    };
+    auto hashRows = [&](const vector<Phone>& phones) {
+        vector<RowHashes> hashes(phones.size());
+        parallelFor((phones.size() + MORSEL_ROWS - 1) / MORSEL_ROWS, [&](size_t m) {
+            for (size_t i = m * MORSEL_ROWS; i < min(phones.size(), (m + 1) * MORSEL_ROWS); i++) {
+                hashes[i] = {hashFields<phoneSchema>(phones[i], keyColumns), hashFields<phoneSchema>(phones[i], ALL_COLUMNS & ~keyColumns)};
+            }
+        });
+        return hashes;
+    };
+    vector<RowHashes> beforeHashes = hashRows(before);
+    vector<RowHashes> afterHashes = hashRows(after);
+
+    unsigned partitions = threadPool().size() * 4;
+    vector<vector<int>> beforeParts = partitionByHash(before.size(), partitions, [&](size_t i) { return beforeHashes[i].key; });
+    vector<vector<int>> afterParts = partitionByHash(after.size(), partitions, [&](size_t i) { return afterHashes[i].key; });
+
+    vector<CatalogDiff> partDiffs(partitions);
+    parallelFor(partitions, [&](size_t p) {
+        // Rows are ordered by key hash, then key, then row, so repeated keys are matched in file order
+        auto sortOnKey = [](vector<int>& rows, const vector<Phone>& phones, const vector<RowHashes>& hashes) {
+            sort(rows.begin(), rows.end(), [&](int a, int b) {
+                return tie(hashes[a].key, phones[a].brand, phones[a].model, a) < tie(hashes[b].key, phones[b].brand, phones[b].model, b);
+            });
+        };
+        vector<int>& beforeRows = beforeParts[p];
+        vector<int>& afterRows = afterParts[p];
+        sortOnKey(beforeRows, before, beforeHashes);
+        sortOnKey(afterRows, after, afterHashes);
+
+        CatalogDiff& diff = partDiffs[p];
+        size_t i = 0, j = 0;
+        while (i < beforeRows.size() || j < afterRows.size()) {
+            int order;
+            if (i == beforeRows.size()) {
+                order = 1;
+            } else if (j == afterRows.size()) {
+                order = -1;
+            } else {
+                const Phone& a = before[beforeRows[i]];
+                const Phone& b = after[afterRows[j]];
+                auto keyA = tie(beforeHashes[beforeRows[i]].key, a.brand, a.model);
+                auto keyB = tie(afterHashes[afterRows[j]].key, b.brand, b.model);
+                order = keyA < keyB ? -1 : keyB < keyA ? 1 : 0;
+            }
+            if (order < 0) {
+                diff.removed.push_back(beforeRows[i++]);
+            } else if (order > 0) {
+                diff.added.push_back(afterRows[j++]);
+            } else {
+                if (beforeHashes[beforeRows[i]].content != afterHashes[afterRows[j]].content) {
+                    diff.changed.push_back({beforeRows[i], afterRows[j]});
+                } else {
+                    diff.unchanged++;
+                }
+                i++;
+                j++;
+            }
+        }
+    });
+
+    CatalogDiff diff;
+    for (const CatalogDiff& part : partDiffs) {
+        diff.added.insert(diff.added.end(), part.added.begin(), part.added.end());
+        diff.removed.insert(diff.removed.end(), part.removed.begin(), part.removed.end());
+        diff.changed.insert(diff.changed.end(), part.changed.begin(), part.changed.end());
+        diff.unchanged += part.unchanged;
+    }
+    sort(diff.added.begin(), diff.added.end());
+    sort(diff.removed.begin(), diff.removed.end());
+    sort(diff.changed.begin(), diff.changed.end());
+    return diff;
+}
+
+// Function to copy the selected fields of a record (bit i is field i of the schema) into another record
+template <const auto& Schema, typename Record>
+void copyColumns(const Record& from, Record& to, unsigned columns) {
+    [&]<size_t... I>(index_sequence<I...>) {
+        ((columns & (1u << I) ? void(to.*get<I>(Schema).member = from.*get<I>(Schema).member) : void()), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+}
+
+// Function to append a record to a binary buffer: strings as their length (4 bytes) and bytes, numbers as their bytes
+template <const auto& Schema, typename Record>
+void encodeRecord(string& out, const Record& r) {
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            const auto& value = r.*get<I>(Schema).member;
+            if constexpr (is_same_v<decay_t<decltype(value)>, string>) {
+                uint32_t length = value.size();
+                out.append((const char*) &length, sizeof(length));
+                out += value;
+            } else {
+                out.append((const char*) &value, sizeof(value));
+            }
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+}
+
+// Function to read a record written by encodeRecord from p, moving p past it
+// Returns false if the buffer ends before the record does
+template <const auto& Schema, typename Record>
+bool decodeRecord(const char*& p, const char* end, Record& r) {
+    bool complete = true;
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            auto& value = r.*get<I>(Schema).member;
+            if constexpr (is_same_v<decay_t<decltype(value)>, string>) {
+                uint32_t length;
+                if (!complete || end - p < (long) sizeof(length)) {
+                    complete = false;
+                    return;
+                }
+                memcpy(&length, p, sizeof(length));
+                p += sizeof(length);
+                if (end - p < (long) length) {
+                    complete = false;
+                    return;
+                }
+                value.assign(p, length);
+                p += length;
+            } else {
+                if (!complete || end - p < (long) sizeof(value)) {
+                    complete = false;
+                    return;
+                }
+                memcpy(&value, p, sizeof(value));
+                p += sizeof(value);
+            }
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    return complete;
+}
+
+// Function to append a record to a csv buffer as one line; text with a comma, quote or newline is quoted,
+// and numbers are written with the fewest digits that read back as the same value
+template <const auto& Schema, typename Record>
+void appendCsvRecord(string& out, const Record& r) {
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            if (I > 0) {
+                out += ',';
+            }
+            const auto& value = r.*get<I>(Schema).member;
+            if constexpr (is_same_v<decay_t<decltype(value)>, string>) {
+                if (value.find_first_of(",\"\r\n") == string::npos) {
+                    out += value;
+                    return;
+                }
+                out += '"';
+                for (char c : value) {
+                    out += c;
+                    if (c == '"') {
+                        out += '"';
+                    }
+                }
+                out += '"';
+            } else {
+                char text[32];
+                char* end = to_chars(text, text + sizeof(text), value).ptr;
+                out.append(text, end);
+            }
+        }(), ...);
+    }(make_index_sequence<tuple_size_v<decay_t<decltype(Schema)>>>());
+    out += '\n';
+}
+
+// Table of the CRC-32 (IEEE polynomial) of every byte value, computed at compile time
+constexpr auto crc32Table = []() {
+    array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+// Function to compute the CRC-32 checksum of a buffer
+uint32_t crc32(const char* data, size_t size) {
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc32Table[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Kinds of edits of the catalog. Every edit names its phones by brand and model:
+// Set changes one column of every phone with the key, Upsert overwrites them (or adds the phone if there is none)
+// and Remove deletes them. Each edit only depends on its key, so replaying edits that were already applied
+// gives the same catalog again
+enum class EditType : uint8_t { Set = 1, Upsert = 2, Remove = 3 };
+
+// One edit of the catalog
+struct CatalogEdit {
+    EditType type;
+    // Column changed by a Set edit (one column bit)
+    unsigned column = 0;
+    // Brand and model of the phones to edit, and the new values for Set and Upsert
+    Phone phone;
+};
+
+// Function to encode an edit as the payload of a log record: its type, its column and the phone
+string encodeEdit(const CatalogEdit& edit) {
+    string payload;
+    payload += (char) edit.type;
+    payload += (char) edit.column;
+    encodeRecord<phoneSchema>(payload, edit.phone);
+    return payload;
+}
+
+// Function to decode the payload of a log record; returns false if it is not a valid edit
+bool decodeEdit(const char* p, const char* end, CatalogEdit& edit) {
+    if (end - p < 2 || p[0] < (char) EditType::Set || p[0] > (char) EditType::Remove) {
+        return false;
+    }
+    edit.type = (EditType) p[0];
+    edit.column = (unsigned char) p[1];
+    p += 2;
+    return decodeRecord<phoneSchema>(p, end, edit.phone) && p == end;
+}
+
+// Append-only log of catalog edits, so edits survive a crash without rewriting the data files
+// The file starts with a header: 8 magic bytes and the sequence number the log continues from. Then come the
+// records: payload length (4 bytes), CRC-32 of the sequence number and payload (4 bytes), sequence number (8 bytes)
+// and payload. Appended records wait in a buffer until they are committed (group commit): the first committer
+// writes the whole buffer and syncs it once, and the committers that arrive meanwhile wait for it and usually
+// find their records already durable
+struct WriteAheadLog {
+    static constexpr char MAGIC[] = "CA1EDITS";
+    static constexpr size_t HEADER_SIZE = 16;
+    static constexpr size_t RECORD_HEADER_SIZE = 16;
+
+    string path;
+    int fd = -1;
+    // Size of the file up to the last durable record
+    off_t fileSize = 0;
+    mutex lock;
+    condition_variable synced;
+    string pending;
+    uint64_t lastLsn = 0;
+    uint64_t durableLsn = 0;
+    bool syncing = false;
+    bool failed = false;
+    // Records in the log since the last checkpoint, and the number of syncs done
+    size_t records = 0;
+    size_t syncs = 0;
+
+    ~WriteAheadLog() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Function to open the log, creating it if needed, and return the edits it holds
+    // Reading stops at the first record that is incomplete, fails its checksum or is out of sequence: it is the
+    // end of a write that was never committed, so it is cut off together with anything after it.
+    // Returns false if the file cannot be opened or is not an edit log
+    bool open(const string& filename, vector<CatalogEdit>& recovered) {
+        TraceSpan span("recover edit log");
+        path = filename;
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            return false;
+        }
+        string data(info.st_size, '\0');
+        if (readFully(fd, data.data(), data.size(), 0) != (long) data.size()) {
+            return false;
+        }
+        // A file shorter than the header was cut off while the header of a new log was written, so it holds no edits
+        if (data.size() < HEADER_SIZE && memcmp(data.data(), MAGIC, min<size_t>(data.size(), 8)) == 0) {
+            return writeHeader(0);
+        }
+        if (data.size() < HEADER_SIZE || memcmp(data.data(), MAGIC, 8) != 0) {
+            return false;
+        }
+        memcpy(&lastLsn, data.data() + 8, sizeof(lastLsn));
+
+        size_t pos = HEADER_SIZE;
+        while (data.size() - pos >= RECORD_HEADER_SIZE) {
+            uint32_t length, checksum;
+            uint64_t lsn;
+            memcpy(&length, data.data() + pos, sizeof(length));
+            memcpy(&checksum, data.data() + pos + 4, sizeof(checksum));
+            memcpy(&lsn, data.data() + pos + 8, sizeof(lsn));
+            if (data.size() - pos - RECORD_HEADER_SIZE < length || lsn != lastLsn + 1
+                || crc32(data.data() + pos + 8, length + 8) != checksum) {
+                break;
+            }
+            CatalogEdit edit;
+            const char* payload = data.data() + pos + RECORD_HEADER_SIZE;
+            if (!decodeEdit(payload, payload + length, edit)) {
+                break;
+            }
+            recovered.push_back(move(edit));
+            lastLsn = lsn;
+            pos += RECORD_HEADER_SIZE + length;
+        }
+        if (pos < data.size() && (ftruncate(fd, pos) != 0 || fsync(fd) != 0)) {
+            return false;
+        }
+        fileSize = pos;
+        durableLsn = lastLsn;
+        records = recovered.size();
+        return true;
+    }
+
+    // Function to write the header and drop every record; the log then continues after sequence number lsn
+    // The header is written before the file is cut, so after a crash in between the old records are out of sequence
+    bool writeHeader(uint64_t lsn) {
+        char header[HEADER_SIZE];
+        memcpy(header, MAGIC, 8);
+        memcpy(header + 8, &lsn, sizeof(lsn));
+        if (!writeFully(fd, header, HEADER_SIZE, 0) || fsync(fd) != 0 || ftruncate(fd, HEADER_SIZE) != 0 || fsync(fd) != 0) {
+            return false;
+        }
+        fileSize = HEADER_SIZE;
+        return true;
+    }
+
+    // Function to add an edit to the buffer of the log and return its sequence number
+    // The edit is not durable until commit returns for this number
+    uint64_t append(const CatalogEdit& edit) {
+        string payload = encodeEdit(edit);
+        lock_guard<mutex> guard(lock);
+        uint64_t lsn = ++lastLsn;
+        uint32_t length = payload.size();
+        char header[RECORD_HEADER_SIZE];
+        memcpy(header, &length, sizeof(length));
+        memcpy(header + 8, &lsn, sizeof(lsn));
+        size_t start = pending.size();
+        pending.append(header, RECORD_HEADER_SIZE);
+        pending += payload;
+        uint32_t checksum = crc32(pending.data() + start + 8, length + 8);
+        memcpy(pending.data() + start + 4, &checksum, sizeof(checksum));
+        records++;
+        return lsn;
+    }
+
+    // Function to wait until the record with sequence number lsn and every record before it are on disk
+    // If no sync is running this thread writes and syncs everything buffered so far, for all committers at once.
+    // Returns false if the log could not be written; the log then refuses every later commit
+    bool commit(uint64_t lsn) {
+        unique_lock<mutex> guard(lock);
+        while (durableLsn < lsn) {
+            if (failed) {
+                return false;
+            }
+            if (syncing) {
+                synced.wait(guard);
+                continue;
+            }
+            syncing = true;
+            string batch;
+            batch.swap(pending);
+            uint64_t batchLsn = lastLsn;
+            off_t offset = fileSize;
+            guard.unlock();
+            bool written = writeFully(fd, batch.data(), batch.size(), offset) && fsync(fd) == 0;
+            guard.lock();
+            syncing = false;
+            if (written) {
+                fileSize = offset + batch.size();
+                durableLsn = batchLsn;
+                syncs++;
+            } else {
+                failed = true;
+            }
+            synced.notify_all();
+        }
+        return !failed;
+    }
+
+    // Function to empty the log after a checkpoint; every appended edit must be committed first
+    bool reset() {
+        lock_guard<mutex> guard(lock);
+        if (failed || !pending.empty() || !writeHeader(lastLsn)) {
+            return false;
+        }
+        records = 0;
+        return true;
+    }
+};
+
+// Rows of every (brand, model) key of the phones, as (hash of the key, row) pairs in increasing order, so edits
+// find their rows with a binary search instead of a scan. Rows added since the index was built are kept apart
+// in recent, so an addition does not move the whole array, and are merged in when they grow too large.
+// The index is built the first time edits are applied and applyEdits keeps it up to date; any other change of
+// the data (loading, deduplication, clustering) increments dataVersion, and the index is then rebuilt
+struct EditKeyIndex {
+    static constexpr unsigned keyColumns = BRAND_COLUMN | MODEL_COLUMN;
+    vector<pair<uint64_t, int>> sorted;
+    vector<pair<uint64_t, int>> recent;
+    unsigned long long version = 0;
+    bool built = false;
+
+    // Function to check whether the index still describes the phones
+    bool current() const {
+        return built && version == dataVersion;
+    }
+
+    // Function to index all phones from scratch; the key columns must be decoded
+    void build(const vector<Phone>& phones, const vector<Shard>& shards) {
+        TraceSpan span("build edit key index");
+        sorted.resize(phones.size());
+        vector<pair<size_t, size_t>> morsels = shardMorsels(shards);
+        parallelFor(morsels.size(), [&](size_t m) {
+            for (size_t i = morsels[m].first; i < morsels[m].second; i++) {
+                sorted[i] = {hashFields<phoneSchema>(phones[i], keyColumns), (int) i};
+            }
+        });
+        sort(sorted.begin(), sorted.end());
+        recent.clear();
+        built = true;
+    }
+
+    // Function to call visit(row) for every row whose key has the hash, in increasing row order
+    // Recent rows were added after every row of sorted, so they come last
+    template <typename Visit>
+    void forEachRow(uint64_t hash, Visit visit) const {
+        for (const vector<pair<uint64_t, int>>* rows : {&sorted, &recent}) {
+            for (auto it = lower_bound(rows->begin(), rows->end(), pair<uint64_t, int>(hash, INT_MIN));
+                 it != rows->end() && it->first == hash; ++it) {
+                visit(it->second);
+            }
+        }
+    }
+
+    // Function to add a row after every row already in the index
+    void add(const vector<Phone>& phones, size_t row) {
+        pair<uint64_t, int> entry(hashFields<phoneSchema>(phones[row], keyColumns), (int) row);
+        recent.insert(upper_bound(recent.begin(), recent.end(), entry), entry);
+        if (recent.size() > max<size_t>(1024, sorted.size() / 8)) {
+            vector<pair<uint64_t, int>> merged(sorted.size() + recent.size());
+            merge(sorted.begin(), sorted.end(), recent.begin(), recent.end(), merged.begin());
+            sorted.swap(merged);
+            recent.clear();
+        }
+    }
+
+    // Function to drop removed rows and renumber the rows that moved, after a compaction
+    // newRow holds the new index of every row from first on, or -1 if it was removed. Rows only move
+    // towards the start and keep their order, so the pairs stay sorted
+    void renumber(size_t first, const vector<int>& newRow) {
+        for (vector<pair<uint64_t, int>>* rows : {&sorted, &recent}) {
+            size_t write = 0;
+            for (pair<uint64_t, int> entry : *rows) {
+                if ((size_t) entry.second >= first) {
+                    entry.second = newRow[entry.second - first];
+                    if (entry.second < 0) {
+                        continue;
+                    }
+                }
+                (*rows)[write++] = entry;
+            }
+            rows->resize(write);
+        }
+    }
+};
+
+// Function to apply catalog edits to the phones, in order
+// The rows of the edited keys are looked up in keyIndex, so after the index is built the work depends on the
+// number of edits and not on the size of the catalog. Lazily loaded shards only decode brand and model for the
+// index; a lazy shard with changed rows is decoded completely first, so decoding it later cannot overwrite the edits.
+// Added phones go to an "edits" shard at the end of the vector and removed rows are dropped in one compaction
+// at the end, which also moves the field offsets of lazy shards and the index entries of the moved rows; clustered
+// shards keep their brand ranges and file order. The statistics of changed shards are rebuilt the next time they are used
+void applyEdits(vector<Phone>& phones, vector<Shard>& shards, const vector<CatalogEdit>& edits, Deduplicator* dedup,
+                EditKeyIndex& keyIndex) {
+    if (edits.empty()) {
+        return;
+    }
+    TraceSpan span("apply edits");
+    constexpr unsigned keyColumns = EditKeyIndex::keyColumns;
+    if (!keyIndex.current()) {
+        materializeColumns(phones, shards, keyColumns);
+        keyIndex.build(phones, shards);
+    }
+    auto sameKey = [](const Phone& p, const Phone& q) { return p.brand == q.brand && p.model == q.model; };
+
+    // Number the distinct keys of the edits and find the rows of every key
+    vector<const Phone*> keys;
+    unordered_map<uint64_t, vector<int>> keysByHash;
+    vector<int> keyOfEdit(edits.size());
+    for (size_t e = 0; e < edits.size(); e++) {
+        vector<int>& ids = keysByHash[hashFields<phoneSchema>(edits[e].phone, keyColumns)];
+        auto found = find_if(ids.begin(), ids.end(), [&](int k) { return sameKey(*keys[k], edits[e].phone); });
+        if (found == ids.end()) {
+            ids.push_back(keys.size());
+            keys.push_back(&edits[e].phone);
+            found = ids.end() - 1;
+        }
+        keyOfEdit[e] = *found;
+    }
+    vector<vector<int>> rowsOfKey(keys.size());
+    for (size_t k = 0; k < keys.size(); k++) {
+        keyIndex.forEachRow(hashFields<phoneSchema>(*keys[k], keyColumns), [&](int row) {
+            if (sameKey(*keys[k], phones[row])) {
+                rowsOfKey[k].push_back(row);
+            }
+        });
+    }
+
+    // The shard of a row is the last shard starting at or before it
+    auto shardOf = [&](size_t row) {
+        return upper_bound(shards.begin(), shards.end(), row, [](size_t r, const Shard& s) { return r < s.offset; })
+               - shards.begin() - 1;
+    };
+    for (size_t e = 0; e < edits.size(); e++) {
+        if (edits[e].type != EditType::Remove) {
+            for (int row : rowsOfKey[keyOfEdit[e]]) {
+                materializeShardColumns(phones, shards[shardOf(row)], ALL_COLUMNS);
+            }
+        }
+    }
+    vector<bool> changedShard(shards.size(), false);
+    vector<bool> removed(phones.size(), false);
+    size_t firstRemoved = SIZE_MAX;
+    size_t firstAdded = phones.size();
+    for (size_t e = 0; e < edits.size(); e++) {
+        const CatalogEdit& edit = edits[e];
+        vector<int>& rows = rowsOfKey[keyOfEdit[e]];
+        if (edit.type == EditType::Upsert && rows.empty()) {
+            // Added phones go to the last shard if it holds earlier additions and is not clustered
+            if (shards.empty() || shards.back().source != "edits" || shards.back().clusters.clustered()) {
+                Shard added;
+                added.source = "edits";
+                added.offset = phones.size();
+                shards.push_back(move(added));
+                changedShard.push_back(false);
+            }
+            phones.push_back(edit.phone);
+            removed.push_back(false);
+            shards.back().count++;
+            changedShard.back() = true;
+            rows.push_back(phones.size() - 1);
+            keyIndex.add(phones, phones.size() - 1);
+            continue;
+        }
+        for (int row : rows) {
+            if (edit.type == EditType::Set) {
+                copyColumns<phoneSchema>(edit.phone, phones[row], edit.column);
+            } else if (edit.type == EditType::Upsert) {
+                phones[row] = edit.phone;
+            } else {
+                removed[row] = true;
+                firstRemoved = min<size_t>(firstRemoved, row);
+            }
+            changedShard[shardOf(row)] = true;
+        }
+        if (edit.type == EditType::Remove) {
+            rows.clear();
+        }
+    }
+
+    // Move the remaining rows together, shard by shard from the first removed row
+    // The rows from there on change their index: the key index renumbers them, and they leave the dedup index
+    // while they move
+    bool deduplicating = dedup && dedup->policy != DedupPolicy::KeepAll;
+    if (firstRemoved != SIZE_MAX) {
+        vector<int> movedTo(phones.size() - firstRemoved, -1);
+        if (deduplicating) {
+            for (size_t i = firstRemoved; i < firstAdded; i++) {
+                dedup->kept.erase(i);
+            }
+        }
+        size_t write = SIZE_MAX;
+        for (Shard& shard : shards) {
+            if (shard.offset + shard.count <= firstRemoved) {
+                continue;
+            }
+            if (write == SIZE_MAX) {
+                write = shard.offset;
+            }
+            size_t shardStart = write;
+            vector<int> newRow(shard.count, -1);
+            vector<uint64_t>& offsets = shard.lazy.offsets;
+            constexpr size_t stride = tuple_size_v<decay_t<decltype(phoneSchema)>> + 1;
+            for (size_t i = shard.offset; i < shard.offset + shard.count; i++) {
+                if (!removed[i]) {
+                    if (write != i) {
+                        phones[write] = move(phones[i]);
+                    }
+                    // Rows only move towards the start of the shard, so the offsets can be moved in place
+                    if (!offsets.empty()) {
+                        copy_n(offsets.begin() + (i - shard.offset) * stride, stride,
+                               offsets.begin() + (write - shardStart) * stride);
+                    }
+                    if (i >= firstRemoved) {
+                        movedTo[i - firstRemoved] = write;
+                    }
+                    newRow[i - shard.offset] = write++;
+                }
+            }
+            if (!offsets.empty()) {
+                offsets.resize((write - shardStart) * stride);
+            }
+            if (shard.clusters.clustered()) {
+                // Rows keep their order, so the brands stay grouped; the directory is rebuilt from the moved rows
+                vector<int> fileOrder;
+                for (int row : shard.clusters.fileOrder) {
+                    if (newRow[row - shard.offset] >= 0) {
+                        fileOrder.push_back(newRow[row - shard.offset]);
+                    }
+                }
+                shard.clusters.brands.clear();
+                for (size_t i = shardStart; i < write; i++) {
+                    auto& range = shard.clusters.brands.try_emplace(phones[i].brand, i, i).first->second;
+                    range.second = i + 1;
+                }
+                shard.clusters.fileOrder = move(fileOrder);
+            }
+            shard.offset = shardStart;
+            shard.count = write - shardStart;
+        }
+        phones.resize(write);
+        keyIndex.renumber(firstRemoved, movedTo);
+    }
+
+    for (size_t s = 0; s < shards.size(); s++) {
+        if (changedShard[s]) {
+            shards[s].stats = PhoneStats();
+            shards[s].lazy.statsPending = true;
+        }
+    }
+    // Added rows always have a new key, and moved rows are added again under their new index
+    if (deduplicating) {
+        for (size_t i = min(firstRemoved, firstAdded); i < phones.size(); i++) {
+            dedup->kept.insert(i);
+        }
+    }
+    dataVersion++;
+    keyIndex.version = dataVersion;
+}
+
+// Function to write the phones to a csv snapshot file in the order of their files
+// The snapshot is written to a temporary file, synced and then renamed, so a crash leaves either the old or the
+// new snapshot complete. Returns false if it cannot be written
+bool writeSnapshot(const string& filename, const vector<Phone>& phones, const vector<Shard>& shards) {
+    TraceSpan span("write snapshot");
+    string text;
+    for (int row : rowsInFileOrder(shards)) {
+        appendCsvRecord<phoneSchema>(text, phones[row]);
+    }
+    string temporary = filename + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = writeFully(fd, text.data(), text.size(), 0) && fsync(fd) == 0;
+    close(fd);
+    if (!written) {
+        return false;
+    }
+    error_code error;
+    filesystem::rename(temporary, filename, error);
+    if (error) {
+        return false;
+    }
+    // Sync the directory so the rename itself is durable
+    filesystem::path directory = filesystem::absolute(filename).parent_path();
+    int directoryFd = open(directory.c_str(), O_RDONLY);
+    if (directoryFd >= 0) {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+    return true;
+}
+
+// Minimal FlatBuffers writer for the Arrow IPC metadata
+// Tables are written parent first and the offsets to their children are patched once the child
+// has been written, so every offset points forward as FlatBuffers requires. Assumes a little-endian host.
+struct FlatBufferWriter {
+    vector<uint8_t> data;
+
+    // One field of a table: its index in the schema, its size in bytes and, for scalars, its value
+    // Offset fields have size 4 and are patched later with patch()
+    struct TableField {
+        int id;
+        size_t size;
+        uint64_t value;
+    };
+
+    void pad(size_t alignment, size_t remainder = 0) {
+        while (data.size() % alignment != remainder) {
+            data.push_back(0);
+        }
+    }
+
+    template <typename T>
+    void put(T value) {
+        size_t pos = data.size();
+        data.resize(pos + sizeof(T));
+        memcpy(&data[pos], &value, sizeof(T));
+    }
+
+    template <typename T>
+    void putAt(size_t pos, T value) {
+        memcpy(&data[pos], &value, sizeof(T));
+    }
+
+    // Function to point the offset stored at slot to the object at target
+    void patch(size_t slot, size_t target) {
+        putAt<uint32_t>(slot, (uint32_t) (target - slot));
+    }
+
+    // Function to write a table with its vtable in front of it
+    // Returns the position of the table and, through fieldPositions, where each field id was stored
+    size_t table(vector<TableField> fields, map<int, size_t>& fieldPositions) {
+        int fieldCount = 0;
+        bool hasLong = false;
+        for (const TableField& f : fields) {
+            fieldCount = max(fieldCount, f.id + 1);
+            hasLong = hasLong || f.size == 8;
+        }
+        // Largest fields first, so every field is naturally aligned
+        stable_sort(fields.begin(), fields.end(), [](const TableField& a, const TableField& b) {
+            return a.size > b.size;
+        });
+
+        pad(2);
+        size_t vtable = data.size();
+        size_t vtableSize = 4 + 2 * fieldCount;
+        size_t tableStart = vtable + vtableSize;
+        while (tableStart % (hasLong ? 8 : 4) != (hasLong ? 4 : 0)) {
+            tableStart++;
+        }
+
+        vector<uint16_t> fieldOffsets(fieldCount, 0);
+        size_t end = 4;
+        for (const TableField& f : fields) {
+            while ((tableStart + end) % f.size != 0) {
+                end++;
+            }
+            fieldOffsets[f.id] = (uint16_t) end;
+            fieldPositions[f.id] = tableStart + end;
+            end += f.size;
+        }
+        while (end % 4 != 0) {
+            end++;
+        }
+
+        put<uint16_t>((uint16_t) vtableSize);
+        put<uint16_t>((uint16_t) end);
+        for (uint16_t offset : fieldOffsets) {
+            put<uint16_t>(offset);
+        }
+        while (data.size() < tableStart) {
+            data.push_back(0);
+        }
+        data.resize(tableStart + end, 0);
+        putAt<int32_t>(tableStart, (int32_t) (tableStart - vtable));
+        for (const TableField& f : fields) {
+            memcpy(&data[fieldPositions[f.id]], &f.value, f.size);
+        }
+        return tableStart;
+    }
+
+    size_t string(const std::string& text) {
+        pad(4);
+        size_t pos = data.size();
+        put<uint32_t>(text.size());
+        data.insert(data.end(), text.begin(), text.end());
+        data.push_back(0);
+        return pos;
+    }
+
+    // Function to write a vector of offsets; returns its position, element i is patched at position + 4 + 4 * i
+    size_t offsetVector(size_t count) {
+        pad(4);
+        size_t pos = data.size();
+        put<uint32_t>(count);
+        data.resize(data.size() + 4 * count, 0);
+        return pos;
+    }
+
+    // Function to write a vector of structs made of 64-bit values, e.g. Arrow FieldNode and Buffer
+    size_t longStructVector(const vector<int64_t>& values, size_t valuesPerStruct) {
+        pad(8, 4);
+        size_t pos = data.size();
+        put<uint32_t>(values.size() / valuesPerStruct);
+        for (int64_t value : values) {
+            put<int64_t>(value);
+        }
+        return pos;
+    }
+};
+
+// Arrow type of a C++ column type
+template <typename T>
+void writeArrowType(FlatBufferWriter& fb, map<int, size_t>& field) {
+    // Arrow Type union: Int = 2, FloatingPoint = 3, Utf8 = 5
+    map<int, size_t> type;
+    size_t typeTable;
+    if constexpr (is_same_v<T, string>) {
+        fb.putAt<uint8_t>(field[2], 5);
+        typeTable = fb.table({}, type);
+    } else if constexpr (is_integral_v<T>) {
+        fb.putAt<uint8_t>(field[2], 2);
+        typeTable = fb.table({{0, 4, sizeof(T) * 8}, {1, 1, is_signed_v<T>}}, type);
+    } else {
+        // Precision: SINGLE = 1, DOUBLE = 2
+        fb.putAt<uint8_t>(field[2], 3);
+        typeTable = fb.table({{0, 2, sizeof(T) == 4 ? 1u : 2u}}, type);
+    }
+    fb.patch(field[3], typeTable);
+}
+
+// Function to write an Arrow Schema table for a record schema: one non-nullable field per schema field
+template <const auto& Schema>
+size_t writeArrowSchema(FlatBufferWriter& fb) {
+    constexpr size_t fieldCount = tuple_size_v<decay_t<decltype(Schema)>>;
+    // Schema: endianness = 0 (little), fields = 1
+    map<int, size_t> schema;
+    size_t schemaTable = fb.table({{0, 2, 0}, {1, 4, 0}}, schema);
+    size_t fields = fb.offsetVector(fieldCount);
+    fb.patch(schema[1], fields);
+
+    [&]<size_t... I>(index_sequence<I...>) {
+        ([&]() {
+            using T = typename decay_t<decltype(get<I>(Schema))>::Type;
+            // Field: name = 0, nullable = 1, type_type = 2, type = 3, children = 5
+            map<int, size_t> field;
+            size_t fieldTable = fb.table({{0, 4, 0}, {1, 1, 0}, {2, 1, 0}, {3, 4, 0}, {5, 4, 0}}, field);
+            fb.patch(fields + 4 + 4 * I, fieldTable);
+            fb.patch(field[0], fb.string(get<I>(Schema).name));
+            writeArrowType<T>(fb, field);
+            fb.patch(field[5], fb.offsetVector(0));
+        }(), ...);
+    }(make_index_sequence<fieldCount>());
+    return schemaTable;
+}
+
+// Function to write one Arrow IPC message: continuation marker, metadata length, metadata and body
+// headerType is the MessageHeader union type (Schema = 1, RecordBatch = 3); writeHeader writes the header table
+// Returns the number of metadata bytes written including the 8-byte prefix
+template <typename WriteHeader>
+size_t writeArrowMessage(ostream& out, uint8_t headerType, int64_t bodyLength, WriteHeader writeHeader) {
+    FlatBufferWriter fb;
+    fb.put<uint32_t>(0);
+    // Message: version = 0 (V5 = 4), header_type = 1, header = 2, bodyLength = 3
+    map<int, size_t> message;
+    size_t messageTable = fb.table({{0, 2, 4}, {1, 1, headerType}, {2, 4, 0}, {3, 8, (uint64_t) bodyLength}}, message);
+    fb.patch(0, messageTable);
+    fb.patch(message[2], writeHeader(fb));
+    fb.pad(8);
+
+    uint32_t prefix[2] = {0xFFFFFFFFu, (uint32_t) fb.data.size()};
+    out.write((const char*) prefix, sizeof(prefix));
+    out.write((const char*) fb.data.data(), fb.data.size());
+    return sizeof(prefix) + fb.data.size();
+}
+
+// Function to export the rows [offset, offset + limit) of a cursor as Arrow IPC
+// Each batch of rows is gathered into the column storage of phoneSchema, whose numeric vectors are the Arrow
+// data buffers as they are, so no text is formatted
+// Files ending in .arrows get the stream format, anything else the file format that readers can mmap
+// Returns false if the file cannot be written
+bool exportArrow(const string& filename, const vector<Phone>& phones, const ResultCursor& cursor,
+                 size_t offset = 0, size_t limit = SIZE_MAX) {
+    TraceSpan span("export arrow");
+    const size_t batchRows = 1 << 16;
+    const size_t alignment = 64;
+    bool fileFormat = !(filename.size() >= 7 && filename.compare(filename.size() - 7, 7, ".arrows") == 0);
+    ofstream out(filename, ios::binary);
+    if (!out) {
+        return false;
+    }
+
+    // Blocks of the record batches: offset, metadata length and body length, for the file footer
+    vector<int64_t> blocks;
+    int64_t position = 0;
+    if (fileFormat) {
+        out.write("ARROW1\0\0", 8);
+        position = 8;
+    }
+    position += writeArrowMessage(out, 1, 0, [](FlatBufferWriter& fb) {
+        return writeArrowSchema<phoneSchema>(fb);
+    });
+
+    size_t begin = min(offset, cursor.total);
+    size_t end = begin + min(limit, cursor.total - begin);
+    vector<char> body;
+    for (size_t first = begin; first < end; first += batchRows) {
+        size_t rows = min(batchRows, end - first);
+        body.clear();
+        vector<int64_t> nodes, buffers;
+        auto addBuffer = [&](const void* bytes, size_t size) {
+            buffers.push_back(body.size());
+            buffers.push_back(size);
+            body.insert(body.end(), (const char*) bytes, (const char*) bytes + size);
+            body.resize((body.size() + alignment - 1) / alignment * alignment, 0);
+        };
+
+        // The rows of the batch are copied into the column storage of the schema, one vector per field
+        vector<int> rowIds(rows);
+        for (size_t r = 0; r < rows; r++) {
+            rowIds[r] = cursor.rowAt(first + r);
+        }
+        ColumnsFor<phoneSchema> columns = gatherColumns<phoneSchema>(phones, rowIds);
+
+        // Each column: a field node, an empty validity buffer (no nulls) and its data buffers
+        apply([&](const auto&... column) {
+            ([&](const auto& values) {
+                using T = typename decay_t<decltype(values)>::value_type;
+                nodes.push_back(rows);
+                nodes.push_back(0);
+                addBuffer(nullptr, 0);
+                if constexpr (is_same_v<T, string>) {
+                    vector<int32_t> offsets(rows + 1, 0);
+                    string text;
+                    for (size_t r = 0; r < rows; r++) {
+                        text += values[r];
+                        offsets[r + 1] = text.size();
+                    }
+                    addBuffer(offsets.data(), offsets.size() * sizeof(int32_t));
+                    addBuffer(text.data(), text.size());
+                } else {
+                    addBuffer(values.data(), values.size() * sizeof(T));
+                }
+            }(column), ...);
+        }, columns);
+
+        size_t metadata = writeArrowMessage(out, 3, body.size(), [&](FlatBufferWriter& fb) {
+            // RecordBatch: length = 0, nodes = 1, buffers = 2
+            map<int, size_t> batch;
+            size_t batchTable = fb.table({{0, 8, rows}, {1, 4, 0}, {2, 4, 0}}, batch);
+            fb.patch(batch[1], fb.longStructVector(nodes, 2));
+            fb.patch(batch[2], fb.longStructVector(buffers, 2));
+            return batchTable;
+        });
+        out.write(body.data(), body.size());
+        blocks.push_back(position);
+        blocks.push_back(metadata);
+        blocks.push_back(body.size());
+        position += metadata + body.size();
+    }
+
+    // End of stream marker
+    uint32_t endOfStream[2] = {0xFFFFFFFFu, 0};
+    out.write((const char*) endOfStream, sizeof(endOfStream));
+
+    if (fileFormat) {
+        FlatBufferWriter fb;
+        fb.put<uint32_t>(0);
+        // Footer: version = 0, schema = 1, dictionaries = 2, recordBatches = 3
+        map<int, size_t> footer;
+        size_t footerTable = fb.table({{0, 2, 4}, {1, 4, 0}, {2, 4, 0}, {3, 4, 0}}, footer);
+        fb.patch(0, footerTable);
+        fb.patch(footer[1], writeArrowSchema<phoneSchema>(fb));
+        fb.patch(footer[2], fb.longStructVector({}, 3));
+        // Block struct: offset (8 bytes), metaDataLength (4 bytes + 4 padding), bodyLength (8 bytes)
+        vector<int64_t> blockValues;
+        for (size_t b = 0; b < blocks.size(); b += 3) {
+            blockValues.push_back(blocks[b]);
+            blockValues.push_back(blocks[b + 1]);
+            blockValues.push_back(blocks[b + 2]);
+        }
+        fb.patch(footer[3], fb.longStructVector(blockValues, 3));
+
+        out.write((const char*) fb.data.data(), fb.data.size());
+        int32_t footerSize = fb.data.size();
+        out.write((const char*) &footerSize, sizeof(footerSize));
+        out.write("ARROW1", 6);
+    }
+    return (bool) out;
+}
+
+// Bytes used and wasted by a structure
+// Wasted bytes are allocated but hold no data: vector capacity past the size, string capacity past the
+// text, and the rounding of heap blocks by the allocator
+struct MemoryUsage {
+    size_t used = 0;
+    size_t wasted = 0;
+
+    void add(const MemoryUsage& other) {
+        used += other.used;
+        wasted += other.wasted;
+    }
+};
+
+// Function to return the size of the heap block holding an allocation of requested bytes
+// Without an allocator query, blocks are assumed to be rounded up to 16 bytes
+size_t heapBlockSize(const void* block, size_t requested) {
+#if defined(HAVE_MALLOC_USABLE_SIZE)
+    if (block) {
+        return malloc_usable_size(const_cast<void*>(block));
+    }
+#elif defined(__APPLE__)
+    if (block) {
+        return malloc_size(block);
+    }
+#endif
+    return (requested + 15) / 16 * 16;
+}
+
+// Function to measure the heap part of a string; short strings are stored inside the string object (SSO)
+MemoryUsage stringMemory(const string& text) {
+    MemoryUsage usage;
+    const char* data = text.data();
+    bool inline_ = data >= (const char*) &text && data < (const char*) &text + sizeof(text);
+    if (!inline_) {
+        usage.used = text.size() + 1;
+        usage.wasted = heapBlockSize(data, text.capacity() + 1) - usage.used;
+    }
+    return usage;
+}
+
+// Function to measure the buffer of a vector, not counting what its elements own
+template <typename T>
+MemoryUsage vectorMemory(const vector<T>& values) {
+    MemoryUsage usage;
+    if (values.capacity() > 0) {
+        usage.used = values.size() * sizeof(T);
+        usage.wasted = heapBlockSize(values.data(), values.capacity() * sizeof(T)) - usage.used;
+    }
+    return usage;
+}
+
+// Function to estimate the memory of a node of a list, map or hash table holding value bytes
+// Node containers do not expose their nodes, so the node is assumed to be one heap block
+MemoryUsage nodeMemory(size_t pointers, size_t value) {
+    MemoryUsage usage;
+    usage.used = pointers * sizeof(void*) + value;
+    usage.wasted = (usage.used + 15) / 16 * 16 - usage.used;
+    return usage;
+}
+
+// Function to measure the quantile sketch and histogram of one column
+MemoryUsage columnStatsMemory(const ColumnStats& stats) {
+    MemoryUsage usage = vectorMemory(stats.quantiles.levels);
+    for (const vector<float>& level : stats.quantiles.levels) {
+        usage.add(vectorMemory(level));
+    }
+    usage.add(vectorMemory(stats.histogram.buckets));
+    return usage;
+}
+
+// Function to display one line of the memory report
+void displayMemoryLine(const string& name, const MemoryUsage& usage, size_t rows) {
+    cout << left << setw(30) << name << right
+    << setw(16) << usage.used
+    << setw(16) << usage.wasted
+    << setw(14) << fixed << setprecision(1) << (rows == 0 ? 0.0 : (double) (usage.used + usage.wasted) / rows)
+    << left << endl;
+}
+
+// Function to display how much memory the phones, the shards, the query cache, the dedup index, the
+// autocomplete index and the edit key index use. Per row is the sum of used and wasted bytes divided by the number of phones
+void displayMemoryReport(const vector<Phone>& phones, const vector<Shard>& shards, const QueryCache* cache,
+                         const Deduplicator* dedup, const ModelIndex* modelIndex, const EditKeyIndex* keyIndex) {
+    size_t rows = phones.size();
+    MemoryUsage total;
+    cout << "\n----Memory usage----" << endl;
+    cout << left << setw(30) << "Structure" << right << setw(16) << "Bytes used" << setw(16) << "Bytes wasted"
+    << setw(14) << "Per row" << left << endl;
+
+    // The phones: the vector holding the Phone objects and the heap text of brands and models too long for SSO
+    MemoryUsage table = vectorMemory(phones);
+    MemoryUsage brands, models;
+    size_t heapStrings = 0;
+    for (const Phone& p : phones) {
+        MemoryUsage brand = stringMemory(p.brand);
+        MemoryUsage model = stringMemory(p.model);
+        heapStrings += (brand.used > 0) + (model.used > 0);
+        brands.add(brand);
+        models.add(model);
+    }
+    displayMemoryLine("Phone objects (vector)", table, rows);
+    displayMemoryLine("Brand text on heap", brands, rows);
+    displayMemoryLine("Model text on heap", models, rows);
+    total.add(table);
+    total.add(brands);
+    total.add(models);
+
+    MemoryUsage shardUsage = vectorMemory(shards);
+    for (const Shard& shard : shards) {
+        shardUsage.add(stringMemory(shard.source));
+        shardUsage.add(stringMemory(shard.lazy.text));
+        shardUsage.add(vectorMemory(shard.lazy.offsets));
+        shardUsage.add(columnStatsMemory(shard.stats.price));
+        shardUsage.add(columnStatsMemory(shard.stats.screenSize));
+        shardUsage.add(columnStatsMemory(shard.stats.releaseYear));
+        shardUsage.add(vectorMemory(shard.clusters.fileOrder));
+        for (const auto& brand : shard.clusters.brands) {
+            shardUsage.add(nodeMemory(3, sizeof(brand) + sizeof(int)));
+            shardUsage.add(stringMemory(brand.first));
+        }
+    }
+    displayMemoryLine("Shards and statistics", shardUsage, rows);
+    total.add(shardUsage);
+
+    if (cache) {
+        MemoryUsage cacheUsage;
+        for (const auto& entry : cache->entries) {
+            // List node, hash table node with a copy of the key, key text and the shared result
+            cacheUsage.add(nodeMemory(2, sizeof(entry)));
+            cacheUsage.add(nodeMemory(1, sizeof(string) + sizeof(void*) + sizeof(size_t)));
+            cacheUsage.add(stringMemory(entry.first));
+            cacheUsage.add(stringMemory(entry.first));
+            cacheUsage.add(nodeMemory(2, sizeof(QueryResult)));
+            cacheUsage.add(vectorMemory(entry.second->rowIds));
+            for (const auto& count : entry.second->counts) {
+                cacheUsage.add(nodeMemory(3, sizeof(count) + sizeof(int)));
+                cacheUsage.add(stringMemory(count.first));
+            }
+        }
+        cacheUsage.add({cache->index.bucket_count() * sizeof(void*), 0});
+        displayMemoryLine("Query cache", cacheUsage, rows);
+        total.add(cacheUsage);
+    }
+
+    if (dedup && dedup->policy != DedupPolicy::KeepAll) {
+        MemoryUsage dedupUsage;
+        for (size_t i = 0; i < dedup->kept.size(); i++) {
+            dedupUsage.add(nodeMemory(1, sizeof(int) + sizeof(size_t)));
+        }
+        dedupUsage.add({dedup->kept.bucket_count() * sizeof(void*), 0});
+        displayMemoryLine("Dedup index", dedupUsage, rows);
+        total.add(dedupUsage);
+    }
+
+    if (modelIndex && modelIndex->built) {
+        // The sorted rows, the rows added since, and the two segment trees
+        MemoryUsage indexUsage = vectorMemory(modelIndex->sorted);
+        indexUsage.add(vectorMemory(modelIndex->recent));
+        indexUsage.add(vectorMemory(modelIndex->bestPrice));
+        indexUsage.add(vectorMemory(modelIndex->bestYear));
+        displayMemoryLine("Autocomplete index", indexUsage, rows);
+        total.add(indexUsage);
+    }
+
+    if (keyIndex && keyIndex->built) {
+        MemoryUsage keyUsage = vectorMemory(keyIndex->sorted);
+        keyUsage.add(vectorMemory(keyIndex->recent));
+        displayMemoryLine("Edit key index", keyUsage, rows);
+        total.add(keyUsage);
+    }
+
+    displayMemoryLine("Total", total, rows);
+    cout << "\nPhones: " << rows << ", sizeof(Phone): " << sizeof(Phone)
+    << " bytes, strings stored on the heap: " << heapStrings << " of " << 2 * rows << endl;
+    cout << "Node sizes of the cache and dedup index are estimated" << endl;
+}
+
+// Function to display the menu
+void displayMenu() {
+    cout << "\n----Menu----" << endl;
+    cout << "\n1. Display all phones" << endl;
+    cout << "2. Search index of phone by model" << endl;
+    cout << "3. Count the number of phones of each brand" << endl;
+    cout << "4. Display phones of a particular brand" << endl;
+    cout << "5. Find Highest, Lowest, and Average Release Year" << endl;
+    cout << "6. Search Phones by Partial Text\n";
+    cout << "7. Display Phones in Descending Order of Price\n";
+    cout << "8. Fuzzy Search Phones by Model\n";
+    cout << "9. Display Query Cache Statistics\n";
+    cout << "10. Sort Phones by Column\n";
+    cout << "11. Add Data Shard\n";
+    cout << "12. Display Price, Screen Size and Release Year Statistics\n";
+    cout << "13. Export Query Results to Arrow File\n";
+    cout << "14. Join Phones with CSV File by Model\n";
+    cout << "15. Display Memory Usage\n";
+    cout << "16. Display Top Phones per Brand\n";
+    cout << "17. Display Release Year Trends\n";
+    cout << "18. Sort Phones by Several Columns\n";
+    cout << "19. Autocomplete Model Names\n";
+    cout << "20. Compare with Newer Catalog\n";
+    cout << "21. Edit Phones\n";
+    cout << "22. Checkpoint Edit Log\n";
+    cout << "23. Exit" << endl;
+}
+
+// Function to return the lazily loaded columns a menu option decodes before it runs
+// Counting brands only needs the brand, the statistics only the numeric columns, and the options that display
+// phones need every column. Autocomplete, editing and checkpoints decode their columns themselves once their
+// input is valid, and invalid choices decode nothing
+unsigned menuColumns(int choice) {
+    switch (choice) {
+        case 3:
+            return BRAND_COLUMN;
+        case 12:
+        case 17:
+            return RELEASE_YEAR_COLUMN | PRICE_COLUMN | SCREEN_SIZE_COLUMN;
+        case 1: case 2: case 4: case 5: case 6: case 7: case 8: case 10:
+        case 13: case 14: case 16: case 18: case 20:
+            return ALL_COLUMNS;
+        default:
+            return 0;
+    }
+}
+
+// Function to read the column and order words of a sort or top query, e.g. price desc
+// Returns false if they are not valid
+bool parseRanking(const string& columnWord, const string& orderWord, PhoneColumn& column, bool& descending) {
+    map<string, PhoneColumn> columns = {
+        {"year", PhoneColumn::ReleaseYear}, {"price", PhoneColumn::Price}, {"screen", PhoneColumn::ScreenSize}
+    };
+    if (!columns.count(columnWord) || (orderWord != "asc" && orderWord != "desc")) {
+        return false;
+    }
+    column = columns[columnWord];
+    descending = orderWord == "desc";
+    return true;
+}
+
+// Function to read a multi-column sort specification: pairs of column (brand, model, year, price, screen)
+// and order (asc, desc) words, starting at query[first]; returns nothing if the words are not valid
+optional<vector<SortKey>> parseSortKeys(const vector<string>& query, size_t first) {
+    map<string, unsigned> columns = {
+        {"brand", BRAND_COLUMN}, {"model", MODEL_COLUMN}, {"year", RELEASE_YEAR_COLUMN},
+        {"price", PRICE_COLUMN}, {"screen", SCREEN_SIZE_COLUMN}
+    };
+    vector<SortKey> sortKeys;
+    if (first >= query.size() || (query.size() - first) % 2 != 0) {
+        return nullopt;
+    }
+    for (size_t i = first; i < query.size(); i += 2) {
+        if (!columns.count(query[i]) || (query[i + 1] != "asc" && query[i + 1] != "desc")) {
+            return nullopt;
+        }
+        sortKeys.push_back({columns[query[i]], query[i + 1] == "desc"});
+    }
+    return sortKeys;
+}
+
+// Function to read the number of rows per brand of a top query; returns 0 if it is not a positive number
+size_t parseTopCount(const string& word) {
+    // stoul accepts a leading minus sign and wraps it around to a huge count
+    if (word.find('-') != string::npos) {
+        return 0;
+    }
+    try {
+        return stoul(word);
+    } catch (const exception&) {
+        return 0;
+    }
+}
+
+// Function to run a listing query given as words: list, brand <brand>, search <text>,
+// sort <year|price|screen> <asc|desc>, top <year|price|screen> <asc|desc> <n> (n best phones per brand)
+// or order <column> <asc|desc> [<column> <asc|desc> ...] (sort on several columns);
+// returns nothing if the words are not a valid query
+optional<ResultCursor> runListingQuery(const vector<string>& query, const vector<Phone>& phones,
+                                       const vector<Shard>& shards, QueryCache& cache) {
+    if (query.size() == 1 && query[0] == "list") {
+        if (anyShardClustered(shards)) {
+            auto result = make_shared<QueryResult>();
+            result->rowIds = rowsInFileOrder(shards);
+            return ResultCursor(result);
+        }
+        return ResultCursor(phones.size());
+    }
+    if (query.size() == 2 && query[0] == "brand") {
+        return queryPhonesByBrand(phones, shards, query[1], cache);
+    }
+    if (query.size() == 2 && query[0] == "search") {
+        return queryPhonesByPartialText(phones, shards, query[1], cache);
+    }
+    PhoneColumn column;
+    bool descending;
+    if (query.size() == 3 && query[0] == "sort" && parseRanking(query[1], query[2], column, descending)) {
+        return queryPhonesSorted(phones, column, descending, cache);
+    }
+    if (query.size() == 4 && query[0] == "top" && parseRanking(query[1], query[2], column, descending)
+        && parseTopCount(query[3]) > 0) {
+        return queryTopPhonesPerBrand(phones, shards, column, descending, parseTopCount(query[3]), cache);
+    }
+    if (query.size() >= 3 && query[0] == "order") {
+        if (optional<vector<SortKey>> sortKeys = parseSortKeys(query, 1)) {
+            string specification;
+            for (size_t i = 1; i < query.size(); i++) {
+                specification += (i > 1 ? " " : "") + query[i];
+            }
+            return queryPhonesOrdered(phones, *sortKeys, specification, cache);
+        }
+    }
+    return nullopt;
+}
+
+// Function to build a streaming pipeline for a listing query given as words, like runListingQuery
+// Nothing is cached or collected: the rows are scanned and filtered only as far as the consumer reads them
+// Top queries need every row before the first one is known, like sort
+optional<Generator<RowBatch>> streamListingQuery(const vector<string>& query, const vector<Phone>& phones,
+                                                 const vector<Shard>& shards) {
+    if (query.size() == 1 && query[0] == "list") {
+        return anyShardClustered(shards) ? rowsOf(rowsInFileOrder(shards)) : scanRows(phones);
+    }
+    if (query.size() == 2 && query[0] == "brand") {
+        return brandRows(phones, shards, query[1]);
+    }
+    if (query.size() == 2 && query[0] == "search") {
+        return filterRows(scanRows(phones), [&phones, text = query[1]](int row) {
+            return phones[row].model.find(text) != string::npos;
+        });
+    }
+    PhoneColumn column;
+    bool descending;
+    if (query.size() == 3 && query[0] == "sort" && parseRanking(query[1], query[2], column, descending)) {
+        return sortRows(scanRows(phones), phones, column, descending);
+    }
+    if (query.size() == 4 && query[0] == "top" && parseRanking(query[1], query[2], column, descending)
+        && parseTopCount(query[3]) > 0) {
+        return rowsOf(topPhonesPerBrand(phones, shards, column, descending, parseTopCount(query[3])));
+    }
+    if (query.size() >= 3 && query[0] == "order") {
+        if (optional<vector<SortKey>> sortKeys = parseSortKeys(query, 1)) {
+            return rowsOf(sortPhoneIdsBy(phones, *sortKeys));
+        }
+    }
+    return nullopt;
+}
 
-// Function to display data of one phone in formatted form
-void displayPhone(const Phone& p) {
-    cout << left
-    << setw(15) << p.brand
-    << setw(35) << p.model
-    << setw(15) << p.releaseYear
-    << setw(15) << fixed << setprecision(2) << p.price
-    << setw(10) << fixed << setprecision(2) << p.screenSize
-    << endl;
+// Function to read an edit given as words: set <brand> <model> <year|price|screen> <value>,
+// add <brand> <model> <year> <price> <screen> (adds the phone or overwrites the phones with its brand and model)
+// or remove <brand> <model>; returns nothing if the words are not a valid edit
+optional<CatalogEdit> parseEdit(const vector<string>& words) {
+    constexpr size_t schemaSize = tuple_size_v<decay_t<decltype(phoneSchema)>>;
+    map<string, unsigned> editableColumns = {
+        {"year", RELEASE_YEAR_COLUMN}, {"price", PRICE_COLUMN}, {"screen", SCREEN_SIZE_COLUMN}
+    };
+    CatalogEdit edit;
+    FieldSpan fields[schemaSize];
+    for (size_t i = 1; i < words.size() && i <= schemaSize; i++) {
+        fields[i - 1] = {words[i].data(), words[i].data() + words[i].size()};
+    }
+    try {
+        if (words.size() == 5 && words[0] == "set" && editableColumns.count(words[3])) {
+            edit.type = EditType::Set;
+            edit.column = editableColumns[words[3]];
+            // The value is the fourth word; it goes in the field of the column
+            fields[countr_zero(edit.column)] = fields[3];
+            convertColumns<phoneSchema>(fields, BRAND_COLUMN | MODEL_COLUMN | edit.column, edit.phone);
+        } else if (words.size() == schemaSize + 1 && words[0] == "add") {
+            edit.type = EditType::Upsert;
+            convertRecord<phoneSchema>(fields, schemaSize, edit.phone);
+        } else if (words.size() == 3 && words[0] == "remove") {
+            edit.type = EditType::Remove;
+            convertColumns<phoneSchema>(fields, BRAND_COLUMN | MODEL_COLUMN, edit.phone);
+        } else {
+            return nullopt;
+        }
+    } catch (const invalid_argument&) {
+        return nullopt;
+    }
+    return edit;
 }
 
-// Function to parse a line of csv data and store it in a Phone object
-void parsePhone(const string& line, Phone& p) {
-    stringstream ss(line);
-    string temp;
+// Function to split one line of csv text into its unquoted fields
+vector<string> splitCsvLine(const string& line) {
+    vector<string> words;
+    CsvScratch scratch;
+    forEachCsvRow(line.data(), line.size(), true, scratch, [&](const vector<FieldSpan>& fields) {
+        if (!words.empty()) {
+            return;
+        }
+        for (FieldSpan field : fields) {
+            words.emplace_back();
+            unquoteField(field, words.back());
+        }
+    });
+    return words;
+}
 
-    getline(ss, p.brand, ',');
-    getline(ss, p.model, ',');
-    getline(ss, temp, ',');
-    p.releaseYear = stoi(temp);
-    getline(ss, temp, ',');
-    p.price = stof(temp);
-    getline(ss, temp, ',');
-    p.screenSize = stof(temp);
+// Function to turn a comma separated list of column names (brand,model,year,price,screen) into column bits
+// Returns 0 if a name is unknown
+unsigned parseColumnList(const string& list) {
+    map<string, unsigned> columns = {
+        {"brand", BRAND_COLUMN}, {"model", MODEL_COLUMN}, {"year", RELEASE_YEAR_COLUMN},
+        {"price", PRICE_COLUMN}, {"screen", SCREEN_SIZE_COLUMN}
+    };
+    unsigned selected = 0;
+    stringstream ss(list);
+    string name;
+    while (getline(ss, name, ',')) {
+        if (!columns.count(name)) {
+            return 0;
+        }
+        selected |= columns[name];
+    }
+    return selected;
 }
 
-// Function to load phone data from a csv file and store it in a vector of Phone objects
-void loadPhones(const string &filename, vector<Phone>& phones) {
-    ifstream fin(filename);
-    if(fin){
-        string line;
-        while(getline(fin, line)) {
-            Phone p;
-            parsePhone(line, p);
-            phones.push_back(p);
+// Function to join the phones with a keyed csv file and run a query on the joined rows
+// The query is a listing query or count (joined rows per brand); in the menu the rows are shown page by page
+// Returns the exit code for batch mode
+int runJoin(const string& filename, const vector<string>& query, const vector<Phone>& phones,
+            bool interactive, size_t offset = 0, size_t limit = SIZE_MAX) {
+    KeyedTable keyed;
+    if (!loadKeyedTable(filename, keyed)) {
+        return 1;
+    }
+    JoinedTable joined = hashJoin(phones, keyed);
+    cout << "Joined rows: " << joined.phones.size() << " (" << keyed.keys.size() << " rows in " << filename << ")" << endl;
+
+    // The joined table gets its own cache, its rows are not covered by the data version
+    QueryCache joinedCache(16);
+    if (query.size() == 1 && query[0] == "count") {
+        cout << "\n----Count of joined rows by brand----" << endl;
+        for (const auto& brandCount : countPhonesByBrand(joined.phones, joined.shards)) {
+            cout << brandCount.first << ": " << brandCount.second << endl;
         }
-        fin.close();
+        return 0;
     }
-    else {
-        cout << "Error opening file" << endl;
+    optional<ResultCursor> cursor = runListingQuery(query, joined.phones, joined.shards, joinedCache);
+    if (!cursor) {
+        cout << "Invalid query" << endl;
+        return 1;
+    }
+    ExtraColumns extra = joinedColumns(joined, keyed);
+    if (interactive) {
+        browseResults(joined.phones, *cursor, 20, &extra);
+    } else {
+        displayPage(joined.phones, *cursor, offset, limit, &extra);
     }
+    return 0;
 }
 
-// Function to display all phones from the vector with a formatted header
-void displayAllPhones(const vector<Phone>& phones) {
-    cout << left
-    << setw(15) << "Brand"
-    << setw(35) << "Model"
-    << setw(15) << "Release Year"
-    << setw(15) << "Price"
-    << setw(10) << "Screen Size"
-    << endl;
+// Function to compare the loaded phones with a newer version of the catalog and display the added,
+// removed and changed phones. The source can be a csv file, a directory or a wildcard pattern like the data source
+// Returns the exit code for batch mode
+int runDiff(const string& source, const vector<Phone>& phones) {
+    vector<string> files = resolveDataSources(source);
+    if (files.empty()) {
+        cout << "No data files found for: " << source << endl;
+        return 1;
+    }
+    vector<Phone> newPhones;
+    vector<Shard> newShards;
+    loadPhoneShards(files, newPhones, newShards);
+    CatalogDiff diff = diffCatalogs(phones, newPhones);
 
-    for (const Phone& p : phones) {
-        displayPhone(p);
+    cout << "\n----Added phones: " << diff.added.size() << "----" << endl;
+    if (!diff.added.empty()) {
+        renderHeader<phoneSchema>(cout);
+        for (int row : diff.added) {
+            renderRecord<phoneSchema>(cout, newPhones[row]);
+        }
+    }
+    cout << "\n----Removed phones: " << diff.removed.size() << "----" << endl;
+    if (!diff.removed.empty()) {
+        renderHeader<phoneSchema>(cout);
+        for (int row : diff.removed) {
+            renderRecord<phoneSchema>(cout, phones[row]);
+        }
+    }
+    cout << "\n----Changed phones: " << diff.changed.size() << "----" << endl;
+    for (auto [oldRow, newRow] : diff.changed) {
+        renderRecord<phoneSchema>(cout, phones[oldRow], false, BRAND_COLUMN | MODEL_COLUMN);
+        renderChangedFields<phoneSchema>(cout, phones[oldRow], newPhones[newRow]);
+        cout << endl;
     }
+    cout << "\nUnchanged phones: " << diff.unchanged << endl;
+    return 0;
 }
 
-// Function to search for a phone by model and return its index in the vector
-// Returns -1 if not found 
-int searchPhoneByModel(const vector<Phone>& phones, const string& model) {
-    for (int i = 0; i < phones.size(); i++) {
-        if (phones[i].model == model) {
-            return i;
+// Function to log a list of edits and then apply them to the phones
+// All edits are appended to the log and committed together, so the whole list costs one sync and is durable
+// before any of it is visible. Returns false if the log cannot be written
+bool logAndApplyEdits(WriteAheadLog& wal, const vector<CatalogEdit>& edits, vector<Phone>& phones, vector<Shard>& shards,
+                      Deduplicator* dedup, EditKeyIndex& keyIndex) {
+    uint64_t lsn = 0;
+    for (const CatalogEdit& edit : edits) {
+        lsn = wal.append(edit);
+    }
+    if (!wal.commit(lsn)) {
+        cout << "Error writing edit log: " << wal.path << endl;
+        return false;
+    }
+    applyEdits(phones, shards, edits, dedup, keyIndex);
+    return true;
+}
+
+// Function to read a csv file of edits, one per line as in parseEdit (e.g. set,Nokia,Nokia 3310,price,49.99)
+// Returns nothing if the file cannot be read or a line is not a valid edit
+optional<vector<CatalogEdit>> loadEditFile(const string& filename) {
+    vector<CatalogEdit> edits;
+    bool valid = true;
+    bool loaded = readCsvFile(filename, [&](const vector<FieldSpan>& fields) {
+        vector<string> words(fields.size());
+        for (size_t f = 0; f < fields.size(); f++) {
+            unquoteField(fields[f], words[f]);
+        }
+        optional<CatalogEdit> edit = parseEdit(words);
+        if (valid && !edit) {
+            cout << "Invalid edit on line " << edits.size() + 1 << " of " << filename << endl;
+            valid = false;
         }
+        if (edit) {
+            edits.push_back(move(*edit));
+        }
+    });
+    return loaded && valid ? optional(move(edits)) : nullopt;
+}
+
+// Function to write a snapshot of the phones next to the edit log and empty the log, so the next start loads the
+// snapshot and only replays the edits made after it. Returns false if the snapshot or the log cannot be written
+bool checkpointEdits(WriteAheadLog& wal, const vector<Phone>& phones, const vector<Shard>& shards) {
+    TraceSpan span("checkpoint");
+    if (!wal.commit(wal.lastLsn) || !writeSnapshot(wal.path + ".snapshot", phones, shards) || !wal.reset()) {
+        cout << "Error writing checkpoint of edit log: " << wal.path << endl;
+        return false;
     }
-    return -1;
+    cout << "Checkpoint written to " << wal.path << ".snapshot with " << phones.size() << " phones, edit log emptied" << endl;
+    return true;
 }
 
-// Function to count the number of phones of each brand
-// Returns a map with brand as key and the number of phones with that brand as value
-map<string, int> countPhonesByBrand(const vector<Phone>& phones) {
-    map<string, int> count;
-    for (const Phone& p : phones) {
-        count[p.brand]++;
+// Function to split a query typed in the menu into words
+// Brand names and search text may contain spaces, so everything after the command is one word for them
+vector<string> splitQuery(const string& line) {
+    stringstream ss(line);
+    string command, rest;
+    ss >> command;
+    getline(ss >> ws, rest);
+    if (command != "sort" && command != "top" && command != "order") {
+        return rest.empty() ? vector<string>{command} : vector<string>{command, rest};
     }
-    return count;
+    vector<string> words = {command};
+    stringstream restStream(rest);
+    string word;
+    while (restStream >> word) {
+        words.push_back(word);
+    }
+    return words;
 }
 
-// Function to display phones of a particular brand
-void displayPhonesByBrand(const vector<Phone>& phones, const string& brand) {
-    vector<Phone> filteredPhones;
-    for (const Phone& p : phones) {
-        if (p.brand == brand) {
-            filteredPhones.push_back(p);
+// Function to run one query of a replayed query log, without the cache, and return the size of its result
+// Returns nothing if the words are not a query the replay knows:
+// model <model>, brand <brand>, search <text>, stats, sort <year|price|screen> <asc|desc> or count
+optional<size_t> runLoggedQuery(const vector<string>& query, const vector<Phone>& phones, const vector<Shard>& shards) {
+    PhoneColumn column;
+    bool descending;
+    if (query.size() == 2 && query[0] == "model") {
+        return searchPhoneByModel(phones, query[1]) >= 0 ? 1 : 0;
+    }
+    if (query.size() == 2 && query[0] == "brand") {
+        return findPhonesByBrand(phones, shards, query[1]).size();
+    }
+    if (query.size() == 2 && query[0] == "search") {
+        return searchPhoneByPartialText(phones, shards, query[1]).size();
+    }
+    if (query.size() == 1 && query[0] == "stats") {
+        return mergeShardStats(shards).price.quantiles.count;
+    }
+    if (query.size() == 3 && query[0] == "sort" && parseRanking(query[1], query[2], column, descending)) {
+        return sortPhoneIds(phones, column, descending).size();
+    }
+    if (query.size() == 1 && query[0] == "count") {
+        return countPhonesByBrand(phones, shards).size();
+    }
+    return nullopt;
+}
+
+// Function to return the value at quantile q of sorted latencies
+double latencyQuantile(const vector<double>& sorted, double q) {
+    return sorted[min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+}
+
+// Function to replay a log of queries (one per line, see runLoggedQuery) from several client threads
+// and display the throughput and latency percentiles of every query type
+// With a rate the queries are started on a fixed schedule of rate queries per second over all clients.
+// The latency of a query is measured from the time it was scheduled to start, not from when a client got
+// to it, so a slow query also counts against the queries that had to wait behind it (correcting for
+// coordinated omission). Without a rate every client starts its next query as soon as the last one ends.
+// The queries run on the shared thread pool, so the clients compete for it like concurrent users would
+int replayQueryLog(const string& filename, unsigned clients, double rate, const vector<Phone>& phones,
+                   const vector<Shard>& shards) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cout << "Error opening file" << endl;
+        return 1;
+    }
+    vector<vector<string>> queries;
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        queries.push_back(splitQuery(line));
+        // Running the query on an empty table checks it without doing any work
+        if (!runLoggedQuery(queries.back(), {}, {})) {
+            cout << "Invalid query in " << filename << ": " << line << " (use model, brand, search, stats, sort or count)" << endl;
+            return 1;
         }
     }
+    if (queries.empty()) {
+        cout << "No queries in " << filename << endl;
+        return 1;
+    }
 
-    if (filteredPhones.empty()) {
-        cout << "No phones found for brand: " << brand << endl;
-    } else {
-        cout << "\n----Phones of brand " << brand << "----" << endl;
-        cout << left
-        << setw(15) << "Brand"
-        << setw(35) << "Model"
-        << setw(15) << "Release Year"
-        << setw(15) << "Price"
-        << setw(10) << "Screen Size"
-        << endl;
+    // Latencies of every client by query type, merged after the run so the clients share nothing but the counter
+    using Clock = chrono::steady_clock;
+    vector<map<string, vector<double>>> clientLatencies(clients);
+    atomic<size_t> next = 0;
+    atomic<size_t> resultRows = 0;
+    Clock::time_point start = Clock::now();
+    vector<thread> threads;
+    for (unsigned c = 0; c < clients; c++) {
+        threads.emplace_back([&, c]() {
+            Tracer::threadName = "replay client";
+            for (size_t i = next++; i < queries.size(); i = next++) {
+                TraceSpan span("replayed query");
+                Clock::time_point scheduled = Clock::now();
+                if (rate > 0) {
+                    scheduled = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(i / rate));
+                    this_thread::sleep_until(scheduled);
+                }
+                resultRows += *runLoggedQuery(queries[i], phones, shards);
+                double latency = chrono::duration<double, micro>(Clock::now() - scheduled).count();
+                clientLatencies[c][queries[i][0]].push_back(latency);
+            }
+        });
+    }
+    for (thread& th : threads) {
+        th.join();
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
 
-        for (const Phone& p : filteredPhones) {
-            displayPhone(p);
+    map<string, vector<double>> latencies;
+    for (const auto& client : clientLatencies) {
+        for (const auto& [type, values] : client) {
+            latencies[type].insert(latencies[type].end(), values.begin(), values.end());
+            latencies["all"].insert(latencies["all"].end(), values.begin(), values.end());
         }
     }
+    cout << "\n----Replay of " << queries.size() << " queries from " << clients << " clients";
+    if (rate > 0) {
+        cout << " at " << fixed << setprecision(2) << rate << " queries/s";
+    } else {
+        cout << " as fast as possible";
+    }
+    cout << "----" << endl;
+    cout << left << setw(10) << "Query" << right << setw(10) << "Count" << setw(12) << "Queries/s"
+    << setw(12) << "p50 (us)" << setw(12) << "p99 (us)" << setw(12) << "p99.9 (us)" << setw(12) << "Max (us)" << left << endl;
+    for (auto& [type, values] : latencies) {
+        sort(values.begin(), values.end());
+        cout << left << setw(10) << type << right << setw(10) << values.size()
+        << setw(12) << fixed << setprecision(1) << values.size() / seconds
+        << setw(12) << latencyQuantile(values, 0.5) << setw(12) << latencyQuantile(values, 0.99)
+        << setw(12) << latencyQuantile(values, 0.999) << setw(12) << values.back() << left << endl;
+    }
+    cout << "Elapsed: " << fixed << setprecision(3) << seconds << " s, result rows: " << resultRows << endl;
+    return 0;
 }
 
-//Function to find the highest and lowest release year and to calculate the average release year
-//returns the average release year as an integer
-int findMaxMinAvgReleaseYear(const vector<Phone>& phones, Phone& max, Phone& min) {
-    int sum = 0;
-    int maxReleaseYear = INT_MIN;
-    int minReleaseYear = INT_MAX;
+// Function to display the command line usage
+void displayUsage() {
+    cout << "Usage: CA1 [--dedup first|latest|cheapest] [--lazy] [--cluster] [--wal file] [--threads N] [--pin] [--trace file] [data source] [command] [arguments] [--limit N] [--offset N]" << endl;
+    cout << "           [--columns brand,model,year,price,screen]" << endl;
+    cout << "Commands:" << endl;
+    cout << "  stats                       display price, screen size and release year statistics" << endl;
+    cout << "  complete <prefix> [model|price|recent] [k]" << endl;
+    cout << "                              display the first k (default 10) phones whose model starts with prefix," << endl;
+    cout << "                              by model, highest price or newest release year" << endl;
+    cout << "  trends                      display phone counts, prices and screen sizes per release year" << endl;
+    cout << "  count                       display the number of phones of each brand" << endl;
+    cout << "  memory                      display the memory used by the phones and the structures built on them" << endl;
+    cout << "  list                        display all phones" << endl;
+    cout << "  brand <brand>               display phones of a brand" << endl;
+    cout << "  search <text>               display phones whose model contains the text" << endl;
+    cout << "  sort <year|price|screen> <asc|desc>" << endl;
+    cout << "                              display phones sorted on a column" << endl;
+    cout << "  top <year|price|screen> <asc|desc> <n>" << endl;
+    cout << "                              display the n lowest (asc) or highest (desc) phones of every brand" << endl;
+    cout << "  order <column> <asc|desc> [<column> <asc|desc> ...]" << endl;
+    cout << "                              display phones sorted on several columns (brand, model, year, price, screen)" << endl;
+    cout << "  export <file> <query>       write the result of a listing command (e.g. brand Nokia) as Arrow IPC" << endl;
+    cout << "                              (.arrows files get the stream format, others the file format)" << endl;
+    cout << "  join <file> [query|count]   join with a csv file whose first column is the model and run a" << endl;
+    cout << "                              listing command or count on the joined rows (default: list)" << endl;
+    cout << "  diff <source>               display the phones added, removed or changed in a newer catalog (file," << endl;
+    cout << "                              directory or pattern), matched on brand and model" << endl;
+    cout << "  edit set <brand> <model> <year|price|screen> <value>" << endl;
+    cout << "  edit add <brand> <model> <year> <price> <screen>" << endl;
+    cout << "  edit remove <brand> <model>" << endl;
+    cout << "                              change, add (or overwrite) or remove the phones with a brand and model" << endl;
+    cout << "  apply <file>                make the edits of a csv file, one per line (e.g. set,Nokia,Nokia 3310,price,49.99)" << endl;
+    cout << "  checkpoint                  write the edited phones as a snapshot next to the edit log and empty the log" << endl;
+    cout << "  replay <log> [clients] [rate]" << endl;
+    cout << "                              replay a file of queries (model, brand, search, stats, sort, count; one per" << endl;
+    cout << "                              line) from several clients (default 4) at rate queries per second (default:" << endl;
+    cout << "                              as fast as possible) and display throughput and latency percentiles" << endl;
+    cout << "Listing and export commands only use the rows selected by --offset and --limit" << endl;
+    cout << "Listing commands only display the columns selected by --columns (default: all)" << endl;
+    cout << "--trace writes the time spent loading, querying and rendering as a Chrome trace (opens in Perfetto)" << endl;
+    cout << "--threads sets the number of worker threads (default: one per cpu), --pin pins each worker to a cpu" << endl;
+    cout << "With --lazy the files are only indexed while loading and each column is decoded when a command first uses it" << endl;
+    cout << "With --cluster the phones are stored grouped by brand, so brand filters and counts read only the brand's rows;" << endl;
+    cout << "list still displays them in file order, other listings in stored order" << endl;
+    cout << "--wal logs every edit to a file before it is made; at startup the logged edits are made again on top of the" << endl;
+    cout << "data source, or on top of the snapshot of the last checkpoint if there is one" << endl;
+}
 
-    for (const Phone& p : phones) {
-        sum += p.releaseYear;
+// Function to run one command given on the command line instead of showing the menu
+// Returns the exit code of the program
+// Edit commands need wal, the edit log given with --wal, and keyIndex, the index of the rows of every key
+int runBatchCommand(vector<string> args, vector<Phone>& phones, vector<Shard>& shards, Deduplicator* dedup,
+                    WriteAheadLog* wal, EditKeyIndex& keyIndex) {
+    QueryCache cache(16);
 
-        if (p.releaseYear > maxReleaseYear) {
-            maxReleaseYear = p.releaseYear;
-            max = p;
+    // Take --limit and --offset out of the arguments, by default every row is displayed
+    size_t limit = SIZE_MAX;
+    size_t offset = 0;
+    unsigned columns = ALL_COLUMNS;
+    for (size_t i = 0; i < args.size(); ) {
+        if ((args[i] == "--limit" || args[i] == "--offset") && i + 1 < args.size()) {
+            try {
+                (args[i] == "--limit" ? limit : offset) = stoul(args[i + 1]);
+            } catch (const exception&) {
+                cout << "Invalid number for " << args[i] << ": " << args[i + 1] << endl;
+                return 1;
+            }
+            args.erase(args.begin() + i, args.begin() + i + 2);
+        } else if (args[i] == "--columns" && i + 1 < args.size()) {
+            columns = parseColumnList(args[i + 1]);
+            if (columns == 0) {
+                cout << "Invalid column list: " << args[i + 1] << " (use brand, model, year, price, screen)" << endl;
+                return 1;
+            }
+            args.erase(args.begin() + i, args.begin() + i + 2);
+        } else {
+            i++;
         }
-        if (p.releaseYear < minReleaseYear) {
-            minReleaseYear = p.releaseYear;
-            min = p;
+    }
+    if (args.empty()) {
+        displayUsage();
+        return 1;
+    }
+
+    const string& command = args[0];
+    if (command == "stats") {
+        materializeStats(phones, shards);
+        displayPhoneStats(mergeShardStats(shards));
+        return 0;
+    }
+    if (command == "complete" && args.size() >= 2 && args.size() <= 4) {
+        map<string, CompletionRank> ranks = {
+            {"model", CompletionRank::Model}, {"price", CompletionRank::Price}, {"recent", CompletionRank::Recency}
+        };
+        size_t k = args.size() == 4 ? parseTopCount(args[3]) : 10;
+        if ((args.size() >= 3 && !ranks.count(args[2])) || k == 0) {
+            cout << "Invalid ranking or count" << endl;
+            return 1;
         }
+        materializeColumns(phones, shards, ALL_COLUMNS);
+        ModelIndex index;
+        index.build(phones);
+        displayCompletions(phones, index, args[1], args.size() >= 3 ? ranks[args[2]] : CompletionRank::Model, k);
+        return 0;
     }
-    return sum / phones.size();
+    if (command == "trends") {
+        materializeStats(phones, shards);
+        displayYearTrends(phones, shards);
+        return 0;
+    }
+    if (command == "count") {
+        materializeColumns(phones, shards, BRAND_COLUMN);
+        for (const auto& brandCount : countPhonesByBrand(phones, shards)) {
+            cout << brandCount.first << ": " << brandCount.second << endl;
+        }
+        return 0;
+    }
+    if (command == "memory") {
+        displayMemoryReport(phones, shards, nullptr, dedup, nullptr, &keyIndex);
+        return 0;
+    }
+    if ((command == "edit" || command == "apply" || command == "checkpoint") && !wal) {
+        cout << "Editing needs an edit log, use --wal <file>" << endl;
+        return 1;
+    }
+    // Edits decode only the columns they need, see applyEdits
+    if (command == "edit" && args.size() >= 2) {
+        optional<CatalogEdit> edit = parseEdit(vector<string>(args.begin() + 1, args.end()));
+        if (!edit) {
+            cout << "Invalid edit" << endl;
+            displayUsage();
+            return 1;
+        }
+        return logAndApplyEdits(*wal, {*edit}, phones, shards, dedup, keyIndex) ? 0 : 1;
+    }
+    if (command == "apply" && args.size() == 2) {
+        optional<vector<CatalogEdit>> edits = loadEditFile(args[1]);
+        if (!edits || !logAndApplyEdits(*wal, *edits, phones, shards, dedup, keyIndex)) {
+            return 1;
+        }
+        cout << "Applied " << edits->size() << " edits, log syncs: " << wal->syncs << ", phones: " << phones.size() << endl;
+        return 0;
+    }
+    materializeColumns(phones, shards, ALL_COLUMNS);
+    if (command == "export" && args.size() >= 3) {
+        optional<ResultCursor> cursor = runListingQuery(vector<string>(args.begin() + 2, args.end()), phones, shards, cache);
+        if (cursor) {
+            if (!exportArrow(args[1], phones, *cursor, offset, limit)) {
+                cout << "Error writing file: " << args[1] << endl;
+                return 1;
+            }
+            return 0;
+        }
+    }
+    if (command == "checkpoint" && args.size() == 1) {
+        return checkpointEdits(*wal, phones, shards) ? 0 : 1;
+    }
+    if (command == "replay" && args.size() >= 2 && args.size() <= 4) {
+        unsigned long clients = 4;
+        double rate = 0;
+        try {
+            if (args.size() >= 3) {
+                clients = stoul(args[2]);
+            }
+            if (args.size() >= 4) {
+                rate = stod(args[3]);
+            }
+        } catch (const exception&) {
+            cout << "Invalid number of clients or rate" << endl;
+            return 1;
+        }
+        // stoul wraps a negative count around, so it shows up here as a count above UINT_MAX
+        if (clients == 0 || clients > UINT_MAX || !(rate >= 0) || isinf(rate)) {
+            cout << "Invalid number of clients or rate" << endl;
+            return 1;
+        }
+        // The replayed stats query reads the shard statistics, which edits or lazy loading may have left to build
+        materializeStats(phones, shards);
+        return replayQueryLog(args[1], (unsigned) clients, rate, phones, shards);
+    }
+    if (command == "diff" && args.size() == 2) {
+        return runDiff(args[1], phones);
+    }
+    if (command == "join" && args.size() >= 2) {
+        vector<string> query(args.begin() + 2, args.end());
+        return runJoin(args[1], query.empty() ? vector<string>{"list"} : query, phones, false, offset, limit);
+    }
+    // Listing commands stream their rows, so with --limit only the rows needed are scanned
+    if (optional<Generator<RowBatch>> rows = streamListingQuery(args, phones, shards)) {
+        renderRows(cout, phones, limitRows(move(*rows), offset, limit), columns);
+        return 0;
+    }
+
+    cout << "Unknown command: " << command << endl;
+    displayUsage();
+    return 1;
 }
 
-//Function to search for phones where the model contains a partial text and return a list of matching phones 
-list<Phone> searchPhoneByPartialText(const vector<Phone>& phones, const string& text) {
-    list<Phone> matchingPhones;
-    for(auto it = phones.begin(); it != phones.end(); it++) {
-        //string::npos is returned if the text is not found in the model
-        if (it->model.find(text) != string::npos) {
-            matchingPhones.push_back(*it);
+int main(int argc, char* argv[]) {
+    vector<string> args(argv + 1, argv + argc);
+
+    // --dedup first|latest|cheapest drops repeated brand and model rows while loading
+    DedupPolicy policy = DedupPolicy::KeepAll;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--dedup" && i + 1 < args.size()) {
+            map<string, DedupPolicy> policies = {
+                {"first", DedupPolicy::KeepFirst}, {"latest", DedupPolicy::KeepLatest}, {"cheapest", DedupPolicy::KeepCheapest}
+            };
+            if (!policies.count(args[i + 1])) {
+                cout << "Unknown dedup policy: " << args[i + 1] << " (use first, latest or cheapest)" << endl;
+                return 1;
+            }
+            policy = policies[args[i + 1]];
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            break;
         }
     }
-    return matchingPhones;
-}
 
-//Function to display phones in descending order of price
-void displayPhonesInDescendingOrder(const vector<Phone>& phones){
-    vector<Phone> sortedPhones = phones;
-    sort(sortedPhones.begin(), sortedPhones.end(), [](const Phone& p1, const Phone& p2) {
-        return p1.price > p2.price;
-    });
+    // --threads N sets the number of workers of the shared thread pool, --pin pins each worker to one cpu
+    for (size_t i = 0; i < args.size(); ) {
+        if (args[i] == "--threads" && i + 1 < args.size()) {
+            try {
+                threadPoolConfig.threads = stoul(args[i + 1]);
+            } catch (const exception&) {
+                cout << "Invalid number for --threads: " << args[i + 1] << endl;
+                return 1;
+            }
+            args.erase(args.begin() + i, args.begin() + i + 2);
+        } else if (args[i] == "--pin") {
+            threadPoolConfig.pinned = true;
+            args.erase(args.begin() + i);
+        } else {
+            i++;
+        }
+    }
 
-    cout << "\n----Phones in descending order of price----" << endl;
-    cout << left
-    << setw(15) << "Brand"
-    << setw(35) << "Model"
-    << setw(15) << "Release Year"
-    << setw(15) << "Price"
-    << setw(10) << "Screen Size"
-    << endl;
+    // --trace <file> records spans of the loading and query work and writes them as a Chrome trace at exit
+    string traceFile;
+    auto traceFlag = find(args.begin(), args.end(), "--trace");
+    if (traceFlag != args.end() && traceFlag + 1 != args.end()) {
+        traceFile = *(traceFlag + 1);
+        args.erase(traceFlag, traceFlag + 2);
+        tracer.enabled = true;
+        Tracer::threadName = "main";
+    }
+    auto finishTrace = [&]() {
+        if (!traceFile.empty() && !writeChromeTrace(traceFile)) {
+            cout << "Error writing file: " << traceFile << endl;
+        }
+    };
 
-    for (const Phone& p : sortedPhones) {
-        displayPhone(p);
+    // --lazy only indexes the files at startup and decodes each column the first time it is needed
+    bool lazy = false;
+    auto lazyFlag = find(args.begin(), args.end(), "--lazy");
+    if (lazyFlag != args.end()) {
+        lazy = true;
+        args.erase(lazyFlag);
     }
-}
 
-// Function to display the menu
-void displayMenu() {
-    cout << "\n----Menu----" << endl;
-    cout << "\n1. Display all phones" << endl;
-    cout << "2. Search index of phone by model" << endl;
-    cout << "3. Count the number of phones of each brand" << endl;
-    cout << "4. Display phones of a particular brand" << endl;
-    cout << "5. Find Highest, Lowest, and Average Release Year" << endl;
-    cout << "6. Search Phones by Partial Text\n";
-    cout << "7. Display Phones in Descending Order of Price\n";
-    cout << "8. Exit" << endl;
-}
+    // --cluster stores the rows of every shard grouped by brand, with a directory of the brand ranges
+    bool cluster = false;
+    auto clusterFlag = find(args.begin(), args.end(), "--cluster");
+    if (clusterFlag != args.end()) {
+        cluster = true;
+        args.erase(clusterFlag);
+    }
+
+    // --wal <file> keeps an edit log; edits are only allowed with it
+    string walFile;
+    auto walFlag = find(args.begin(), args.end(), "--wal");
+    if (walFlag != args.end() && walFlag + 1 != args.end()) {
+        walFile = *(walFlag + 1);
+        args.erase(walFlag, walFlag + 2);
+    }
+
+    // The data source can be a csv file, a directory of csv files or a wildcard pattern
+    string source = args.empty() ? "MOCK_DATA.csv" : args[0];
+    vector<string> files = resolveDataSources(source);
+    // After a checkpoint the snapshot holds the data source with every edit before it
+    if (!walFile.empty() && filesystem::exists(walFile + ".snapshot")) {
+        files = {walFile + ".snapshot"};
+    }
+    if (files.empty()) {
+        cout << "No data files found for: " << source << endl;
+    }
 
-int main() {
     vector<Phone> phones;
-    loadPhones("MOCK_DATA.csv", phones);
+    vector<Shard> shards;
+    Deduplicator dedup(policy, phones);
+    loadPhoneShards(files, phones, shards, &dedup, lazy);
+    // Make the logged edits again; the log only holds the edits since the last checkpoint
+    WriteAheadLog wal;
+    vector<CatalogEdit> recovered;
+    if (!walFile.empty() && !wal.open(walFile, recovered)) {
+        cout << "Error opening edit log: " << walFile << endl;
+        return 1;
+    }
+    // The key index built for the logged edits is kept for the edits made later in the session
+    EditKeyIndex keyIndex;
+    applyEdits(phones, shards, recovered, &dedup, keyIndex);
+    if (cluster) {
+        clusterShardsByBrand(phones, shards, 0, &dedup);
+    }
+
+    if (policy != DedupPolicy::KeepAll) {
+        cout << "Duplicate phones removed while loading: " << dedup.removed << endl;
+    }
+    if (args.size() > 1) {
+        int status = runBatchCommand(vector<string>(args.begin() + 1, args.end()), phones, shards, &dedup,
+                                     walFile.empty() ? nullptr : &wal, keyIndex);
+        finishTrace();
+        return status;
+    }
+    if (!walFile.empty()) {
+        cout << "Edits replayed from " << walFile << ": " << recovered.size() << endl;
+    }
+    QueryCache cache(64);
+    // Built the first time autocomplete is used
+    ModelIndex modelIndex;
 
     bool exit = false;
     while (!exit) {
@@ -215,10 +5475,17 @@ int main() {
             continue;
         }
 
+        // Decode the lazily loaded columns the option uses, the statistics options also build the shard statistics
+        if (choice == 12 || choice == 17) {
+            materializeStats(phones, shards);
+        } else if (menuColumns(choice) != 0) {
+            materializeColumns(phones, shards, menuColumns(choice));
+        }
+
         switch (choice) {
             // Display all phones
             case 1:
-                displayAllPhones(phones);
+                displayAllPhones(phones, shards);
                 break;
             case 2: {
                 // Search index of phone by model
@@ -237,7 +5504,13 @@ int main() {
             }
             case 3: {
                 // Count the number of phones of each brand
-                map<string, int> count = countPhonesByBrand(phones);
+                // Keep the result alive while it is printed, the cache may evict or replace its entry
+                shared_ptr<const QueryResult> cached = cache.get("count-by-brand", "", [&]() {
+                    QueryResult result;
+                    result.counts = countPhonesByBrand(phones, shards);
+                    return result;
+                });
+                const map<string, int>& count = cached->counts;
                 cout << "\n----Count of phones by brand----" << endl;
                 for (const auto& brandCount : count) {
                     cout << brandCount.first << ": " << brandCount.second << endl;
@@ -249,7 +5522,7 @@ int main() {
                 string filterBrand;
                 cout << "\nEnter brand to filter: ";
                 getline(cin, filterBrand);
-                displayPhonesByBrand(phones, filterBrand);
+                displayPhonesByBrand(phones, shards, filterBrand, cache);
                 break;
             }
             case 5: {
@@ -268,33 +5541,267 @@ int main() {
                 string text;
                 cout << "\nEnter text to search in model: ";
                 getline(cin, text);
-                list<Phone> matchingPhones = searchPhoneByPartialText(phones, text);
+                ResultCursor matchingPhones = queryPhonesByPartialText(phones, shards, text, cache);
 
-                if(matchingPhones.empty()) {
+                if(matchingPhones.total == 0) {
                     cout << "No phones found" << endl;
                     break;
                 }
 
                 cout << "\n----Phones matching text----" << endl;
-                cout << left
-                << setw(15) << "Brand"
-                << setw(35) << "Model"
-                << setw(15) << "Release Year"
-                << setw(15) << "Price"
-                << setw(10) << "Screen Size"
-                << endl;
-
-                for (const Phone& p : matchingPhones) {
-                    displayPhone(p);
-                }
+                browseResults(phones, matchingPhones);
                 break;
             }
             case 7: {
                 // Display Phones in Descending Order of Price
-                displayPhonesInDescendingOrder(phones);
+                displayPhonesInDescendingOrder(phones, cache);
+                break;
+            }
+            case 8: {
+                // Fuzzy Search Phones by Model
+                string text, countInput;
+                cout << "\nEnter text to search in model: ";
+                getline(cin, text);
+                cout << "Enter number of results (default 10): ";
+                getline(cin, countInput);
+
+                size_t maxResults = 10;
+                try {
+                    if (!countInput.empty()) {
+                        int count = stoi(countInput);
+                        maxResults = count > 0 ? count : 0;
+                    }
+                } catch (const exception&) {
+                    cout << "Invalid number, using 10" << endl;
+                }
+
+                if (normalizeForFuzzySearch(text).size() > MAX_FUZZY_PATTERN) {
+                    cout << "Search text is too long (at most " << MAX_FUZZY_PATTERN << " characters without spaces)" << endl;
+                    break;
+                }
+
+                vector<FuzzyMatch> matches = searchPhoneByFuzzyText(phones, text, maxResults);
+                if (matches.empty()) {
+                    cout << "No phones found" << endl;
+                    break;
+                }
+
+                cout << "\n----Closest phones by model----" << endl;
+                cout << left << setw(10) << "Distance";
+                displayPhoneHeader();
+
+                for (const FuzzyMatch& match : matches) {
+                    cout << left << setw(10) << match.distance;
+                    displayPhone(phones[match.index]);
+                }
+                break;
+            }
+            case 9:
+                // Display Query Cache Statistics
+                cache.displayStats();
+                break;
+            case 10: {
+                // Sort Phones by Column
+                string columnInput, orderInput;
+                cout << "\nSort by (1. Release Year, 2. Price, 3. Screen Size): ";
+                getline(cin, columnInput);
+                cout << "Order (1. Ascending, 2. Descending): ";
+                getline(cin, orderInput);
+
+                PhoneColumn column;
+                if (columnInput == "1") {
+                    column = PhoneColumn::ReleaseYear;
+                } else if (columnInput == "2") {
+                    column = PhoneColumn::Price;
+                } else if (columnInput == "3") {
+                    column = PhoneColumn::ScreenSize;
+                } else {
+                    cout << "Invalid column" << endl;
+                    break;
+                }
+                if (orderInput != "1" && orderInput != "2") {
+                    cout << "Invalid order" << endl;
+                    break;
+                }
+                displayPhonesSorted(phones, column, orderInput == "2", cache);
+                break;
+            }
+            case 11: {
+                // Add Data Shard
+                string filename;
+                cout << "\nEnter csv file to add: ";
+                getline(cin, filename);
+                size_t removedBefore = dedup.removed;
+                if (!addShard(filename, phones, shards, &dedup, lazy)) {
+                    break;
+                }
+                if (cluster) {
+                    clusterShardsByBrand(phones, shards, shards.size() - 1, &dedup);
+                }
+                // Keep the autocomplete index current; with latest or cheapest dedup older rows may have been replaced
+                if (modelIndex.built) {
+                    materializeColumns(phones, shards, MODEL_COLUMN | RELEASE_YEAR_COLUMN | PRICE_COLUMN);
+                    modelIndex.update(phones, policy == DedupPolicy::KeepLatest || policy == DedupPolicy::KeepCheapest);
+                }
+                cout << "Shards loaded: " << shards.size() << ", phones: " << phones.size() << endl;
+                if (policy != DedupPolicy::KeepAll) {
+                    cout << "Duplicate phones removed: " << dedup.removed - removedBefore << endl;
+                }
+                break;
+            }
+            case 12:
+                // Display Price, Screen Size and Release Year Statistics
+                displayPhoneStats(mergeShardStats(shards));
+                break;
+            case 13: {
+                // Export Query Results to Arrow File
+                string queryInput, filename;
+                cout << "\nEnter query (list, brand <brand>, search <text>, sort <year|price|screen> <asc|desc>,\n"
+                     << "top <year|price|screen> <asc|desc> <n>, order <column> <asc|desc> ...): ";
+                getline(cin, queryInput);
+                optional<ResultCursor> cursor = runListingQuery(splitQuery(queryInput), phones, shards, cache);
+                if (!cursor) {
+                    cout << "Invalid query" << endl;
+                    break;
+                }
+                cout << "Enter file name (.arrows for the stream format): ";
+                getline(cin, filename);
+                if (exportArrow(filename, phones, *cursor)) {
+                    cout << "Exported " << cursor->total << " phones to " << filename << endl;
+                } else {
+                    cout << "Error writing file: " << filename << endl;
+                }
                 break;
             }
-            case 8:
+            case 14: {
+                // Join Phones with CSV File by Model
+                string filename, queryInput;
+                cout << "\nEnter csv file to join (first column is the model): ";
+                getline(cin, filename);
+                cout << "Enter query (list, brand <brand>, search <text>, sort <year|price|screen> <asc|desc>,\n"
+                     << "top <year|price|screen> <asc|desc> <n>, order <column> <asc|desc> ..., count): ";
+                getline(cin, queryInput);
+                runJoin(filename, splitQuery(queryInput), phones, true);
+                break;
+            }
+            case 15:
+                // Display Memory Usage
+                displayMemoryReport(phones, shards, &cache, &dedup, &modelIndex, &keyIndex);
+                break;
+            case 16: {
+                // Display Top Phones per Brand
+                string columnInput, orderInput, countInput;
+                cout << "\nRank by (1. Release Year, 2. Price, 3. Screen Size): ";
+                getline(cin, columnInput);
+                cout << "Order (1. Lowest first, 2. Highest first): ";
+                getline(cin, orderInput);
+                cout << "Enter number of phones per brand (default 5): ";
+                getline(cin, countInput);
+
+                PhoneColumn column;
+                if (columnInput == "1") {
+                    column = PhoneColumn::ReleaseYear;
+                } else if (columnInput == "2") {
+                    column = PhoneColumn::Price;
+                } else if (columnInput == "3") {
+                    column = PhoneColumn::ScreenSize;
+                } else {
+                    cout << "Invalid column" << endl;
+                    break;
+                }
+                if (orderInput != "1" && orderInput != "2") {
+                    cout << "Invalid order" << endl;
+                    break;
+                }
+                size_t count = countInput.empty() ? 5 : parseTopCount(countInput);
+                if (count == 0) {
+                    cout << "Invalid number" << endl;
+                    break;
+                }
+                displayTopPhonesPerBrand(phones, shards, column, orderInput == "2", count, cache);
+                break;
+            }
+            case 17:
+                // Display Release Year Trends
+                displayYearTrends(phones, shards);
+                break;
+            case 18: {
+                // Sort Phones by Several Columns
+                string specInput;
+                cout << "\nEnter columns and orders, e.g. brand asc year desc price asc\n"
+                     << "(columns: brand, model, year, price, screen; orders: asc, desc): ";
+                getline(cin, specInput);
+                optional<ResultCursor> cursor = runListingQuery(splitQuery("order " + specInput), phones, shards, cache);
+                if (!cursor) {
+                    cout << "Invalid sort specification" << endl;
+                    break;
+                }
+                cout << "\n----Phones sorted by " << specInput << "----" << endl;
+                browseResults(phones, *cursor);
+                break;
+            }
+            case 19: {
+                // Autocomplete Model Names
+                string rankInput, prefix;
+                cout << "\nOrder completions by (1. Model, 2. Highest price, 3. Newest): ";
+                getline(cin, rankInput);
+                CompletionRank rank = rankInput == "2" ? CompletionRank::Price
+                                      : rankInput == "3" ? CompletionRank::Recency : CompletionRank::Model;
+                while (true) {
+                    cout << "\nEnter start of model (empty to go back): ";
+                    if (!getline(cin, prefix) || prefix.empty()) {
+                        break;
+                    }
+                    // Completions display whole phones, and shards added since the index was built may still be lazy
+                    materializeColumns(phones, shards, ALL_COLUMNS);
+                    if (!modelIndex.built) {
+                        modelIndex.build(phones);
+                    }
+                    displayCompletions(phones, modelIndex, prefix, rank, 10);
+                }
+                break;
+            }
+            case 20: {
+                // Compare with Newer Catalog
+                string source;
+                cout << "\nEnter newer catalog file, directory or pattern: ";
+                getline(cin, source);
+                runDiff(source, phones);
+                break;
+            }
+            case 21: {
+                // Edit Phones
+                if (walFile.empty()) {
+                    cout << "Editing needs an edit log, start the program with --wal <file>" << endl;
+                    break;
+                }
+                string editInput;
+                cout << "\nEnter edit as csv (set,<brand>,<model>,<year|price|screen>,<value>\n"
+                     << "add,<brand>,<model>,<year>,<price>,<screen> or remove,<brand>,<model>): ";
+                getline(cin, editInput);
+                optional<CatalogEdit> edit = parseEdit(splitCsvLine(editInput));
+                if (!edit) {
+                    cout << "Invalid edit" << endl;
+                    break;
+                }
+                if (logAndApplyEdits(wal, {*edit}, phones, shards, &dedup, keyIndex)) {
+                    if (modelIndex.built) {
+                        modelIndex.update(phones, true);
+                    }
+                    cout << "Edit logged and applied, phones: " << phones.size() << endl;
+                }
+                break;
+            }
+            case 22:
+                // Checkpoint Edit Log
+                if (walFile.empty()) {
+                    cout << "No edit log, start the program with --wal <file>" << endl;
+                    break;
+                }
+                materializeColumns(phones, shards, ALL_COLUMNS);
+                checkpointEdits(wal, phones, shards);
+                break;
+            case 23:
                 exit = true;
                 cout << "Exit program" << endl;
                 break;
@@ -304,5 +5811,6 @@ int main() {
         }
     }
 
+    finishTrace();
     return 0;
 }
\ No newline at end of file